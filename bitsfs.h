@@ -3,6 +3,7 @@
 #include <linux/rbtree.h>
 #include <linux/mm.h>
 #include <linux/highmem.h>
+#include <linux/jump_label.h>
 
 /*
  * Bitsfs Magic Number
@@ -16,11 +17,37 @@
 #define    BITSFS_ERROR_FS         0x0002    /* Errors detected */
 #define    BITSFS_CORRUPTED        EUCLEAN   /* Filesystem corrupted */
 
+/*
+ * Incompatible features, a kernel that does not know one must not mount
+ */
+#define    BITSFS_FEATURE_INCOMPAT_VARDENT  0x0001  /* Variable length dirents */
+#define    BITSFS_FEATURE_INCOMPAT_DIRHASH  0x0002  /* Name hash stored in dirents */
+#define    BITSFS_FEATURE_INCOMPAT_LAZYITBL 0x0004  /* Inode table zeroed up to s_itable_zeroed */
+#define    BITSFS_FEATURE_INCOMPAT_DYNINODE 0x0008  /* Inode table chunks in data space */
+#define    BITSFS_FEATURE_INCOMPAT_SEALED   0x0010  /* Packed read-only image, see sealed.c */
+#define    BITSFS_FEATURE_INCOMPAT_SUPP     (BITSFS_FEATURE_INCOMPAT_VARDENT | \
+                                             BITSFS_FEATURE_INCOMPAT_DIRHASH | \
+                                             BITSFS_FEATURE_INCOMPAT_LAZYITBL | \
+                                             BITSFS_FEATURE_INCOMPAT_DYNINODE | \
+                                             BITSFS_FEATURE_INCOMPAT_SEALED)
+
+#define    BITSFS_HAS_INCOMPAT_FEATURE(sb, mask) \
+    (BITFS_S2SI(sb)->s_bs->s_feature_incompat & cpu_to_le32(mask))
+
 /*
  * Inode dynamic state flags
  */
 #define    BITSFS_STATE_NEW        0x00000001 /* inode is newly created */
 
+/*
+ * Inode flags (i_flags), shared with the FS_IOC_GETFLAGS values
+ */
+#define    BITSFS_INDEX_FL         FS_INDEX_FL  /* Hash-indexed directory */
+#define    BITSFS_DIRCOUNT_FL      0x04000000   /* i_dir_entries counts the directory */
+#define    BITSFS_INLINE_DATA_FL   FS_INLINE_DATA_FL  /* Directory entries live in the inode */
+
+#define    BITSFS_FL_USER_VISIBLE     (BITSFS_INDEX_FL)  /* User visible flags */
+
 /*
  * Codes for operating systems
  */
@@ -43,6 +70,7 @@
 #define    BITSFS_NDIR_BLOCKS      4
 #define    BITSFS_TMAX_BLOCKS      (BITSFS_DDIR_BLOCKS + BITSFS_NDIR_BLOCKS)
 #define    BITSFS_NDIR_BLOCK_COUNT 1024
+#define    BITSFS_MAX_DIR_PAGES    (BITSFS_DDIR_BLOCKS + BITSFS_NDIR_BLOCKS * BITSFS_NDIR_BLOCK_COUNT)
 
 /*
  * Block layout
@@ -56,6 +84,26 @@
 #define    BITSFS_INDTBL_BLOCKS    128  /* Inode table blocks count */
 #define    BITSFS_DATA_BLOCK       135  /* Data block start number */
 
+/*
+ * Lazy inode table initialization, see itable.c
+ */
+#define    BITSFS_ITABLE_CHUNK     8    /* Inode table blocks zeroed at a time */
+#define    BITSFS_ITABLE_DELAY     100  /* Default init_itable= msecs between chunks */
+
+/*
+ * Inode table chunks allocated on demand, see imap.c
+ */
+#define    BITSFS_ICHUNK_BLOCKS    16           /* Inode table blocks per chunk */
+#define    BITSFS_IMAP_MAGIC       0x50414d49   /* "IMAP" */
+#define    BITSFS_IMAP_BITMAPS     15           /* Inode bitmap blocks past the first */
+#define    BITSFS_IMAP_CHUNKS      ((BITSFS_BLOCK_SIZE - 8 - 4 * BITSFS_IMAP_BITMAPS) / 4)
+#define    BITSFS_INODES_PER_BITMAP (BITSFS_BLOCK_SIZE * 8)
+
+/*
+ * Inode table blocks, static ones and chunks, numbered in inode order
+ */
+#define    BITSFS_ITABLE_MAX_BLOCKS (BITSFS_INDTBL_BLOCKS + BITSFS_IMAP_CHUNKS * BITSFS_ICHUNK_BLOCKS)
+
 /*
  * Special inode numbers
  */
@@ -63,11 +111,17 @@
 #define    BITSFS_ROOT_INO         2    /* Root inode */
 
 /*
- * Dir file types
+ * Dir file types, the same values as the generic FT_* ones
  */
 #define    BITSFS_FT_UNKNOWN       0
 #define    BITSFS_FT_REG_FILE      1
 #define    BITSFS_FT_DIR           2
+#define    BITSFS_FT_CHRDEV        3
+#define    BITSFS_FT_BLKDEV        4
+#define    BITSFS_FT_FIFO          5
+#define    BITSFS_FT_SOCK          6
+#define    BITSFS_FT_SYMLINK       7
+#define    BITSFS_FT_MAX           8
 
 #define    BITSFS_B2BI(sb)         (sb->s_fs_info)
 
@@ -81,6 +135,118 @@
 #define BITSFS_DIR_REC_LEN(nlen)    (((nlen) + 8 + BITSFS_DIR_ROUND) & ~BITSFS_DIR_ROUND)
 #define BITSFS_MAX_REC_LEN         ((1<<16)-1)  /* max 255 char */
 
+/*
+ * Hashed directory index limits
+ */
+#define    BITSFS_DX_THRESHOLD     8            /* Index directories from this many pages */
+#define    BITSFS_DX_MAX_BLOCKS    BITSFS_NDIR_BLOCK_COUNT  /* Max index extent length */
+#define    BITSFS_DX_MAGIC         0x32584246   /* "FBX2" */
+#define    BITSFS_DX_MAGIC_V1      0x44584246   /* "FBXD", no dx_size, dropped on use */
+#define    BITSFS_DX_DELETED       0xffffffff   /* Tombstone dirent position */
+
+/*
+ * Bitsfs specific ioctls
+ */
+#define    BITSFS_IOC_COMPACT_DIR  _IO('b', 1)  /* Cut the free tail off a directory */
+#define    BITSFS_IOC_BLOOM_STATS  _IOR('b', 2, struct bitsfs_bloom_stats)
+#define    BITSFS_IOC_READDIRPLUS  _IOWR('b', 3, struct bitsfs_readdirplus)
+#define    BITSFS_IOC_BULKSTAT     _IOWR('b', 4, struct bitsfs_bulkstat)
+
+/*
+ * Result of BITSFS_IOC_BLOOM_STATS on a directory
+ */
+struct bitsfs_bloom_stats {
+    __u32    bs_bits_per_name;     /* Mount option dir_bloom= */
+    __u32    bs_bits;              /* Filter size of this directory, 0 without one */
+    __u32    bs_hashes;            /* Bits set per name */
+    __u32    bs_names;             /* Names added to the filter */
+    __u32    bs_stale;             /* Names deleted since it was built */
+    __u32    bs_pad;
+    __u64    bs_probes;            /* Lookups that asked a filter, whole mount */
+    __u64    bs_negative;          /* ... and were answered -ENOENT by it */
+    __u64    bs_false_pos;         /* ... and scanned the directory in vain */
+};
+
+/*
+ * Argument of BITSFS_IOC_READDIRPLUS, which reads on from the file position
+ * like getdents. A zero count means the end of the directory.
+ */
+struct bitsfs_readdirplus {
+    __u64    rp_buf;               /* User buffer for struct bitsfs_dirent_plus records */
+    __u32    rp_size;              /* Its bytes, at most 64K are used */
+    __u32    rp_count;             /* Out: records stored */
+    __u64    rp_pos;               /* Out: file position after the last record */
+};
+
+struct bitsfs_dirent_plus {
+    __u64    dp_ino;
+    __u64    dp_size;
+    __s64    dp_mtime;             /* Seconds */
+    __u32    dp_mode;              /* 0 without search permission on the directory */
+    __u32    dp_nlink;
+    __u16    dp_reclen;            /* Bytes to the next record, a multiple of 8 */
+    __u8     dp_type;              /* DT_* */
+    __u8     dp_namelen;
+    char     dp_name[];            /* NUL terminated */
+};
+
+/*
+ * Argument of BITSFS_IOC_BULKSTAT on any file of the volume, CAP_SYS_ADMIN
+ * only. Returns the allocated inodes from br_ino on in inode number order,
+ * a zero count means there are no more.
+ */
+struct bitsfs_bulkstat {
+    __u64    br_buf;               /* User buffer for struct bitsfs_bstat records */
+    __u32    br_count;             /* Its records, at most 1024 are used */
+    __u32    br_ocount;            /* Out: records stored */
+    __u64    br_ino;               /* First inode, out: the one to go on from */
+};
+
+struct bitsfs_bstat {
+    __u64    bs_ino;
+    __u64    bs_size;
+    __s64    bs_atime;             /* Seconds */
+    __s64    bs_mtime;
+    __s64    bs_ctime;
+    __u32    bs_atime_nsec;
+    __u32    bs_mtime_nsec;
+    __u32    bs_ctime_nsec;
+    __u32    bs_mode;
+    __u32    bs_nlink;
+    __u32    bs_uid;
+    __u32    bs_gid;
+    __u32    bs_flags;             /* FS_IOC_GETFLAGS flags */
+    __u32    bs_blocks;
+    __u32    bs_pad;
+};
+
+/*
+ * In-memory directory name cache limits
+ */
+#define    BITSFS_DCACHE_MIN_PAGES 2            /* Cache directories from this many pages */
+#define    BITSFS_DCACHE_DEFAULT   (1 << 18)    /* Default dir_cache= slot cap per mount */
+
+/*
+ * Directory blocks are preallocated in contiguous runs that double from
+ * one block up to this many
+ */
+#define    BITSFS_DIR_PREALLOC_MAX 64
+
+/*
+ * Bits of i_dir_state, a lookup that finds one set scans instead of
+ * building the same structure in parallel
+ */
+#define    BITSFS_DIR_DCACHE_BUILD 0            /* Name cache being built */
+#define    BITSFS_DIR_BLOOM_BUILD  1            /* Bloom filter being built */
+#define    BITSFS_DIR_DX_CHECKED   2            /* Index matched the directory */
+#define    BITSFS_DIR_DX_FAILED    3            /* Index build failed or outgrown, not retried */
+
+/*
+ * Directory Bloom filter sizing, bits per name
+ */
+#define    BITSFS_BLOOM_DEFAULT    10           /* About 1% false positives */
+#define    BITSFS_BLOOM_MAX        32
+
 /*
  * Bitsfs super block in memory
  */
@@ -107,6 +273,43 @@ struct bitsfs_sb_info {
      */
     spinlock_t s_lock;
     struct dax_device *s_daxdev;                 /* Direct Access device */
+    /*
+     * s_dcache_lock protects s_dcache_lru and installing or removing the
+     * i_dcache pointer of the inodes on it.
+     */
+    spinlock_t s_dcache_lock;
+    struct list_head s_dcache_lru;               /* Directory name caches */
+    atomic_long_t s_dcache_slots;                /* Slots allocated by all name caches */
+    unsigned long s_dcache_max;                  /* Slot cap from mount option dir_cache= */
+    struct shrinker s_dcache_shrinker;
+    unsigned int s_bloom_bits;                   /* Bits per name from mount option dir_bloom= */
+    struct percpu_counter s_bloom_probes;        /* See struct bitsfs_bloom_stats */
+    struct percpu_counter s_bloom_negative;
+    struct percpu_counter s_bloom_false_pos;
+    /*
+     * s_dsync_lock protects s_dsync_list, s_dsync_committing and
+     * s_dsync_last, see dirsync.c.
+     */
+    spinlock_t s_dsync_lock;
+    struct list_head s_dsync_list;               /* Dirsync updates waiting for a commit */
+    int s_dsync_committing;                      /* A commit is being written */
+    unsigned int s_dsync_last;                   /* Updates in the last commit */
+    wait_queue_head_t s_dsync_wait;              /* Updates waiting for a commit to end */
+    struct super_block *s_sb;                    /* Back pointer */
+    unsigned long s_itable_zeroed;               /* Inode table blocks zero on disk, see itable.c */
+    unsigned int s_itable_delay;                 /* Msecs from mount option init_itable= */
+    struct mutex s_itable_mutex;                 /* Serializes moving s_itable_zeroed */
+    struct delayed_work s_itable_work;           /* Zeroes the rest of the table */
+    struct buffer_head *s_imap_bh;               /* Inode chunk map, NULL before the first chunk */
+    struct mutex s_imap_mutex;                   /* Serializes adding inode chunks */
+    unsigned long *s_itable_dirty;               /* Table blocks written to since the last sync_fs */
+    unsigned long *s_itable_flight;              /* ... and submitted by it */
+    struct mutex s_itable_sync;                  /* Serializes bitsfs_itable_sync() */
+    struct list_head s_orphans;                  /* Orphan inodes, see orphan.c */
+    struct mutex s_orphan_mutex;                 /* Protects s_orphans and s_last_orphan */
+    int s_warmup;                                /* Mount option warmup */
+    struct work_struct s_warmup_work;            /* Reads metadata ahead, see warmup.c */
+    int s_debug;                                 /* Mount option debug */
 };
 
 /*
@@ -120,6 +323,16 @@ struct bitsfs_inode_info {
     __u32    i_dir_acl;
     __u32    i_dtime;
     __u32    i_dir_start_lookup;
+    __u32    i_dx_block;         /* First block of the directory hash index */
+    __u32    i_dir_holes;        /* Deleted dirent slots waiting for reuse */
+    __u32    i_dir_entries;      /* Entries besides "." and "..", with BITSFS_DIRCOUNT_FL */
+    unsigned long *i_dir_holemap; /* Pages holding such slots, built on demand */
+    unsigned long i_dir_state;   /* BITSFS_DIR_* bits */
+    unsigned int i_dir_prealloc; /* Blocks of the last directory preallocation */
+    struct bitsfs_dcache __rcu *i_dcache;  /* In-memory name cache of a directory */
+    struct bitsfs_bloom __rcu *i_bloom;    /* Bloom filter of the names of a directory */
+    __u32    i_next_orphan;      /* Next inode on the orphan list */
+    struct list_head i_orphan;   /* On s_orphans */
     struct inode    vfs_inode;
 };
 
@@ -144,7 +357,21 @@ struct bitsfs_super_block {
     __le16    s_state;               /* File system state */
     __le32    s_creator_os;          /* OS */
     char      s_name[8];             /* FS name */
-    __u32     s_reserved[239];       /* Padding to the end of the block */
+    __le32    s_feature_incompat;    /* Incompatible feature set */
+    __le32    s_itable_zeroed;       /* Inode table blocks initialized, with lazy_itable */
+    __le32    s_imap_block;          /* Inode chunk map, 0 before the first chunk */
+    __le32    s_last_orphan;         /* Newest inode on the orphan list */
+    __u32     s_reserved[235];       /* Padding to the end of the block */
+};
+
+/*
+ * Inode chunk map on disk, one block
+ */
+struct bitsfs_imap {
+    __le32    im_magic;              /* BITSFS_IMAP_MAGIC */
+    __le32    im_chunks;             /* Chunks in use */
+    __le32    im_bitmap[BITSFS_IMAP_BITMAPS];  /* Inode bitmap blocks 1.., 0 until needed */
+    __le32    im_chunk[BITSFS_IMAP_CHUNKS];    /* First block of each chunk */
 };
 
 /*
@@ -165,46 +392,233 @@ struct bitsfs_inode {
     __le32    i_block[BITSFS_TMAX_BLOCKS];  /* Pointers to blocks */
     __le32    i_file_acl;       /* File ACL */
     __le32    i_dir_acl;        /* Directory ACL */
-    __u32     i_reserved[5];    /* Padding to 128 bytes */
+    __le32    i_dx_block;       /* Directory hash index extent */
+    __le32    i_dir_holes;      /* Reusable dirent slots of a directory */
+    __le32    i_dir_entries;    /* Live entries of a directory besides "." and ".." */
+    __le32    i_next_orphan;    /* Next inode on the orphan list */
+    __u32     i_reserved[1];    /* Padding to 128 bytes */
 };
 
-#define DENT_NAME_LEN    56
+/*
+ * Inodes made larger by mkfs -I keep BITSFS_INODE_EXTRA bytes after the
+ * above for the fields below and give the rest to tiny directories, see
+ * inline.c
+ */
+#define    BITSFS_GOOD_OLD_INODE_SIZE  128
+#define    BITSFS_INODE_EXTRA          32
+
+/*
+ * Timestamps of a large inode: the seconds are the signed 32 bit ones of
+ * struct bitsfs_inode plus the _hi words shifted by 32, so that zeroed
+ * fields read as before
+ */
+struct bitsfs_inode_extra {
+    __le32    i_atime_hi;       /* Seconds >> 32 */
+    __le32    i_ctime_hi;
+    __le32    i_mtime_hi;
+    __le32    i_atime_nsec;     /* Nanoseconds */
+    __le32    i_ctime_nsec;
+    __le32    i_mtime_nsec;
+    __u32     i_extra_reserved[2];  /* Padding to BITSFS_INODE_EXTRA bytes */
+};
+
+#define DENT_NAME_LEN    56     /* Name limit of fixed size entries */
+#define BITSFS_NAME_LEN  255    /* Name limit with BITSFS_FEATURE_INCOMPAT_VARDENT */
 
 /*
  * Directory entry on disk
+ *
+ * Without the vardent feature every entry is DENT_LEN bytes and a zero
+ * rec_len marks the end of the directory. With it an entry takes
+ * BITSFS_DIR_REC_LEN(name_len) bytes and rec_len chains the entries of a
+ * page, the last one reaching to the end of the page.
  */
 struct bitsfs_dir_entry {
     __le32    inode;          /* Inode number */
-    __le16    rec_len;        /* Fixed value: DENT_LEN */
+    __le16    rec_len;        /* DENT_LEN, or the offset of the next entry */
     __u8      name_len;       /* Real length of name */
     __u8      file_type;      /* File type */
-    char      name[DENT_NAME_LEN];  /* File name */
+    char      name[];         /* File name */
 };
 
-#define DENT_LEN sizeof(struct bitsfs_dir_entry)  // 64 bytes
+#define DENT_LEN (8 + DENT_NAME_LEN)  // 64 bytes
 
-static void bitsfs_msg(struct super_block *sb, const char *prefix, const char *func, 
-        const char *file, int line, const char *fmt, ...)
-{
-    struct va_format vaf;
-    va_list args;
-    va_start(args, fmt);
-    vaf.fmt = fmt;
-    vaf.va = &args;
-    printk("%sBitsFS-%s: %pV -at %s() of %s(%d)\n", prefix, sb->s_id, &vaf, func, file, line);
-    va_end(args);
-}
+/*
+ * With BITSFS_FEATURE_INCOMPAT_DIRHASH an entry ends in the __le32
+ * bitsfs_name_hash() of its name: in the last bytes of a fixed size entry,
+ * right after the name of a variable length one.
+ */
+#define BITSFS_DIR_HASH_LEN  4
+
+/*
+ * Directory hash index on disk
+ *
+ * A contiguous run of blocks holding an open addressing hash table. The
+ * root header sits at the start of the first block and the slots follow.
+ * An empty slot has pos 0 ("." is never indexed), a deleted one has
+ * pos BITSFS_DX_DELETED.
+ */
+struct bitsfs_dx_root {
+    __le32    dx_magic;       /* BITSFS_DX_MAGIC */
+    __le32    dx_blocks;      /* Blocks in the index extent */
+    __le32    dx_count;       /* Live slots */
+    __le32    dx_deleted;     /* Deleted slots */
+    __le32    dx_size;        /* Directory i_size at the last index update */
+    __le32    dx_reserved;
+};
+
+struct bitsfs_dx_entry {
+    __le32    hash;           /* Name hash */
+    __le32    pos;            /* Byte offset of the dirent in the directory */
+};
 
 static inline struct bitsfs_sb_info *BITFS_S2SI(struct super_block *sb)
 {
     return sb->s_fs_info;
 }
 
+/*
+ * Messages below KERN_WARNING only go out on a mount with option debug.
+ * The static key stays off while there is none, so the test is a patched
+ * out branch and their arguments are never evaluated. The hot paths have
+ * tracepoints instead, see bitsfs_trace.h.
+ */
+DECLARE_STATIC_KEY_FALSE(bitsfs_debug_key);
+
+static inline int bitsfs_debug(struct super_block *sb)
+{
+    return static_branch_unlikely(&bitsfs_debug_key) && BITFS_S2SI(sb) && BITFS_S2SI(sb)->s_debug;
+}
+
+extern void __bitsfs_msg(struct super_block *, const char *, const char *, const char *, int,
+        const char *, ...);
+
+#define bitsfs_msg(sb, prefix, func, file, line, fmt, ...)                   \
+do {                                                                          \
+    if (printk_get_level(prefix) <= '0' + LOGLEVEL_WARNING || bitsfs_debug(sb))  \
+        __bitsfs_msg(sb, prefix, func, file, line, fmt, ##__VA_ARGS__);      \
+} while (0)
+
 static inline struct bitsfs_inode_info *BITSFS_I2BI(struct inode *inode)
 {
     return container_of(inode, struct bitsfs_inode_info, vfs_inode);
 }
 
+/*
+ * Bytes of directory entries an inode can hold inline
+ */
+static inline unsigned bitsfs_inline_size(struct super_block *sb)
+{
+    int size = BITFS_S2SI(sb)->s_inode_size - BITSFS_GOOD_OLD_INODE_SIZE - BITSFS_INODE_EXTRA;
+
+    return size > 0 ? size : 0;
+}
+
+/*
+ * Timestamp fields past the first 128 bytes of an inode, NULL for small inodes
+ */
+static inline struct bitsfs_inode_extra *bitsfs_inode_extra(struct super_block *sb,
+        struct bitsfs_inode *raw_inode)
+{
+    if (BITFS_S2SI(sb)->s_inode_size <= BITSFS_GOOD_OLD_INODE_SIZE)
+        return NULL;
+    return (struct bitsfs_inode_extra *)((char *)raw_inode + BITSFS_GOOD_OLD_INODE_SIZE);
+}
+
+static inline void bitsfs_decode_time(struct timespec64 *ts, __le32 sec, __le32 *hi,
+        __le32 *nsec)
+{
+    ts->tv_sec = (signed)le32_to_cpu(sec);
+    ts->tv_nsec = 0;
+    if (hi) {
+        ts->tv_sec += (time64_t)(signed)le32_to_cpu(*hi) << 32;
+        ts->tv_nsec = le32_to_cpu(*nsec);
+    }
+}
+
+static inline void bitsfs_encode_time(struct timespec64 *ts, __le32 *sec, __le32 *hi,
+        __le32 *nsec)
+{
+    *sec = cpu_to_le32(ts->tv_sec);
+    if (hi) {
+        *hi = cpu_to_le32((ts->tv_sec - (signed)(u32)ts->tv_sec) >> 32);
+        *nsec = cpu_to_le32(ts->tv_nsec);
+    }
+}
+
+/*
+ * Inodes of the table made by mkfs, and of each chunk added later
+ */
+static inline unsigned long bitsfs_static_inodes(struct super_block *sb)
+{
+    return BITSFS_INDTBL_BLOCKS * BITSFS_BLOCK_SIZE / BITFS_S2SI(sb)->s_inode_size;
+}
+
+static inline unsigned long bitsfs_chunk_inodes(struct super_block *sb)
+{
+    return BITSFS_ICHUNK_BLOCKS * BITSFS_BLOCK_SIZE / BITFS_S2SI(sb)->s_inode_size;
+}
+
+static inline int bitsfs_has_inline_data(struct inode *inode)
+{
+    return (BITSFS_I2BI(inode)->i_flags & BITSFS_INLINE_DATA_FL) != 0;
+}
+
+static inline int bitsfs_vardent(struct super_block *sb)
+{
+    return BITSFS_HAS_INCOMPAT_FEATURE(sb, BITSFS_FEATURE_INCOMPAT_VARDENT) != 0;
+}
+
+static inline int bitsfs_dirhash(struct super_block *sb)
+{
+    return BITSFS_HAS_INCOMPAT_FEATURE(sb, BITSFS_FEATURE_INCOMPAT_DIRHASH) != 0;
+}
+
+static inline int bitsfs_sealed(struct super_block *sb)
+{
+    return BITSFS_HAS_INCOMPAT_FEATURE(sb, BITSFS_FEATURE_INCOMPAT_SEALED) != 0;
+}
+
+static inline unsigned bitsfs_max_name_len(struct super_block *sb)
+{
+    if (bitsfs_vardent(sb))
+        return BITSFS_NAME_LEN;
+    return DENT_NAME_LEN - (bitsfs_dirhash(sb) ? BITSFS_DIR_HASH_LEN : 0);
+}
+
+/*
+ * Bytes an entry for a `len' bytes name takes
+ */
+static inline unsigned bitsfs_dent_used(struct super_block *sb, int len)
+{
+    if (!bitsfs_vardent(sb))
+        return DENT_LEN;
+    return BITSFS_DIR_REC_LEN(len) + (bitsfs_dirhash(sb) ? BITSFS_DIR_HASH_LEN : 0);
+}
+
+/*
+ * Where a dirhash entry keeps its name hash
+ */
+static inline __le32 *bitsfs_dent_hash(struct super_block *sb, struct bitsfs_dir_entry *de)
+{
+    if (bitsfs_vardent(sb))
+        return (__le32 *)((char *)de + BITSFS_DIR_REC_LEN(de->name_len));
+    return (__le32 *)((char *)de + DENT_LEN - BITSFS_DIR_HASH_LEN);
+}
+
+/*
+ * Dirents a page is expected to hold, for sizing the directory indexes
+ */
+static inline unsigned bitsfs_page_dents(struct super_block *sb)
+{
+    return PAGE_SIZE / (bitsfs_vardent(sb) ? BITSFS_DIR_REC_LEN(12) : DENT_LEN);
+}
+
+static inline struct bitsfs_dir_entry *bitsfs_next_entry(struct bitsfs_dir_entry *de)
+{
+    return (struct bitsfs_dir_entry *)((char *)de + le16_to_cpu(de->rec_len));
+}
+
 /*
  * Atomic bitops
  */
@@ -225,11 +639,18 @@ extern int bitsfs_add_link(struct dentry *, struct inode *);
 extern int bitsfs_get_ino_by_name(struct inode *dir,
                   const struct qstr *child, ino_t *ino);
 extern int bitsfs_make_empty(struct inode *, struct inode *);
+extern struct page *bitsfs_get_page(struct inode *, unsigned long, int, void **);
+extern void bitsfs_dir_readahead(struct inode *, struct file_ra_state *, struct file *,
+                 unsigned long, unsigned long);
+extern struct bitsfs_dir_entry *bitsfs_entry_at(struct inode *, loff_t, const struct qstr *,
+                        struct page **, void **);
 extern struct bitsfs_dir_entry *bitsfs_find_entry(struct inode *, const struct qstr *,
                         struct page **, void **res_page_addr);
 extern int bitsfs_delete_entry(struct inode *dir, struct bitsfs_dir_entry *den, struct page *page,
                  char *kaddr);
 extern int bitsfs_empty_dir(struct inode *);
+extern void bitsfs_dir_holes_drop(struct inode *);
+extern int bitsfs_compact_dir(struct inode *);
 extern struct bitsfs_dir_entry *bitsfs_dotdot(struct inode *dir, struct page **p, void **pa);
 extern void bitsfs_set_link(struct inode *, struct bitsfs_dir_entry *, struct page *, void *,
               struct inode *, int);
@@ -237,6 +658,9 @@ static inline void bitsfs_put_page(struct page *page, void *page_addr);
 extern const struct file_operations bitsfs_dir_operations;
 
 /* inode.c */
+extern struct bitsfs_inode *bitsfs_read_inode(struct super_block *, ino_t, struct buffer_head **);
+extern unsigned long bitsfs_inode_block(struct super_block *, ino_t, unsigned long *);
+extern struct buffer_head *read_inode_bitmap(struct super_block *, unsigned long);
 extern void set_root_inode_bitmap(struct inode *, int) ;
 extern struct inode *bitsfs_iget(struct super_block *, unsigned long);
 extern struct inode *bitsfs_new_inode (struct inode *, umode_t, const struct qstr *);
@@ -251,8 +675,84 @@ extern int bitsfs_get_block(struct inode *, sector_t, struct buffer_head *, int)
 extern void bitsfs_truncate_blocks(struct inode *, loff_t);
 extern void bitsfs_set_file_ops(struct inode *inode);
 extern void bitsfs_set_dir_ops(struct inode *inode);
+extern int bitsfs_new_blocks(struct inode *, int, unsigned long *);
+extern void bitsfs_free_blocks(struct inode *, unsigned long, int);
+extern int bitsfs_sync_block_bitmap(struct super_block *);
 extern const struct address_space_operations bitsfs_aops;
 extern const struct address_space_operations bitsfs_dax_aops;
 
 /* namei.c */
-extern const struct inode_operations bitsfs_dir_inode_operations;
\ No newline at end of file
+extern const struct inode_operations bitsfs_dir_inode_operations;
+
+/* dirindex.c */
+extern u32 bitsfs_name_hash(const char *, int);
+extern u32 bitsfs_dent_name_hash(struct super_block *, struct bitsfs_dir_entry *);
+extern struct bitsfs_dir_entry *bitsfs_dx_find_entry(struct inode *, const struct qstr *,
+                        struct page **, void **);
+extern void bitsfs_dx_add(struct inode *, const char *, int, loff_t);
+extern void bitsfs_dx_delete(struct inode *, const char *, int, loff_t);
+extern void bitsfs_dx_drop(struct inode *);
+
+/* sealed.c */
+extern struct bitsfs_dir_entry *bitsfs_sealed_find_entry(struct inode *, const struct qstr *,
+                        struct page **, void **);
+
+/* dircache.c */
+extern struct bitsfs_dir_entry *bitsfs_dcache_find(struct inode *, const struct qstr *,
+                        struct page **, void **);
+extern void bitsfs_dcache_add(struct inode *, const char *, int, loff_t);
+extern void bitsfs_dcache_delete(struct inode *, const char *, int, loff_t);
+extern void bitsfs_dcache_drop(struct inode *);
+extern unsigned long bitsfs_dcache_count(struct shrinker *, struct shrink_control *);
+extern unsigned long bitsfs_dcache_scan(struct shrinker *, struct shrink_control *);
+
+/* dirbloom.c */
+extern int bitsfs_bloom_test(struct inode *, const struct qstr *);
+extern void bitsfs_bloom_miss(struct inode *, int);
+extern void bitsfs_bloom_add(struct inode *, const char *, int);
+extern void bitsfs_bloom_delete(struct inode *);
+extern void bitsfs_bloom_drop(struct inode *);
+extern void bitsfs_bloom_stats(struct inode *, struct bitsfs_bloom_stats *);
+
+/* dirplus.c */
+extern int bitsfs_readdirplus(struct file *, struct bitsfs_readdirplus *);
+
+/* dirsync.c */
+extern int bitsfs_dirsync(struct inode *);
+
+/* itable.c */
+extern int bitsfs_itable_init(struct super_block *, ino_t);
+extern struct buffer_head *bitsfs_itable_bread(struct super_block *, unsigned long);
+extern void bitsfs_itable_readahead(struct super_block *, unsigned long);
+extern void bitsfs_itable_dirty(struct super_block *, ino_t);
+extern int bitsfs_itable_sync(struct super_block *, int);
+extern void bitsfs_itable_start(struct super_block *);
+extern void bitsfs_itable_stop(struct super_block *);
+
+/* imap.c */
+extern int bitsfs_imap_load(struct super_block *);
+extern unsigned long bitsfs_imap_block(struct super_block *, ino_t, unsigned long *);
+extern unsigned long bitsfs_imap_bitmap(struct super_block *, unsigned long);
+extern int bitsfs_imap_grow(struct inode *, unsigned long);
+
+/* orphan.c */
+extern void bitsfs_orphan_add(struct inode *);
+extern int bitsfs_orphan_sync(struct inode *);
+extern void bitsfs_orphan_del(struct inode *);
+extern void bitsfs_orphan_cleanup(struct super_block *);
+
+/* bulkstat.c */
+extern int bitsfs_bulkstat(struct super_block *, struct bitsfs_bulkstat *);
+
+/* warmup.c */
+extern void bitsfs_warmup_start(struct super_block *);
+extern void bitsfs_warmup_stop(struct super_block *);
+
+/* inline.c */
+extern void bitsfs_inline_dir_init(struct inode *);
+extern int bitsfs_read_inline_page(struct inode *, struct page *);
+extern int bitsfs_write_inline_page(struct inode *, struct page *);
+
+/* ioctl.c */
+extern long bitsfs_ioctl(struct file *, unsigned int, unsigned long);
+extern long bitsfs_compat_ioctl(struct file *, unsigned int, unsigned long);
\ No newline at end of file
@@ -0,0 +1,228 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM bitsfs
+
+#if !defined(_BITSFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BITSFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of block allocation, block mapping, directory entry updates
+ * and inode I/O, under events/bitsfs/ of tracefs. Off they cost a patched
+ * out branch, bitsfs_msg() keeps to errors unless mounted with debug.
+ */
+
+DECLARE_EVENT_CLASS(bitsfs__blocks,
+    TP_PROTO(struct inode *inode, unsigned long block, unsigned int count),
+    TP_ARGS(inode, block, count),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, ino)
+        __field(unsigned long, block)
+        __field(unsigned int, count)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->block = block;
+        __entry->count = count;
+    ),
+
+    TP_printk("dev %d,%d ino %lu block %lu count %u",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+        __entry->block, __entry->count)
+);
+
+DEFINE_EVENT(bitsfs__blocks, bitsfs_alloc_blocks,
+    TP_PROTO(struct inode *inode, unsigned long block, unsigned int count),
+    TP_ARGS(inode, block, count)
+);
+
+DEFINE_EVENT(bitsfs__blocks, bitsfs_free_blocks,
+    TP_PROTO(struct inode *inode, unsigned long block, unsigned int count),
+    TP_ARGS(inode, block, count)
+);
+
+TRACE_EVENT(bitsfs_get_block,
+    TP_PROTO(struct inode *inode, sector_t iblock, u64 pblk, size_t len, int create, int new),
+    TP_ARGS(inode, iblock, pblk, len, create, new),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, ino)
+        __field(sector_t, iblock)
+        __field(u64, pblk)
+        __field(size_t, len)
+        __field(int, create)
+        __field(int, new)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->iblock = iblock;
+        __entry->pblk = pblk;
+        __entry->len = len;
+        __entry->create = create;
+        __entry->new = new;
+    ),
+
+    TP_printk("dev %d,%d ino %lu iblock %llu pblk %llu len %zu create %d new %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+        (unsigned long long)__entry->iblock, __entry->pblk, __entry->len,
+        __entry->create, __entry->new)
+);
+
+TRACE_EVENT(bitsfs_find_entry,
+    TP_PROTO(struct inode *dir, const struct qstr *child, ino_t ino, int err),
+    TP_ARGS(dir, child, ino, err),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __field(ino_t, ino)
+        __field(int, err)
+        __string(name, child->name)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = ino;
+        __entry->err = err;
+        __assign_str(name, child->name);
+    ),
+
+    TP_printk("dev %d,%d dir %lu name %s ino %lu err %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+        __get_str(name), (unsigned long)__entry->ino, __entry->err)
+);
+
+TRACE_EVENT(bitsfs_add_link,
+    TP_PROTO(struct inode *dir, const struct qstr *child, ino_t ino, loff_t pos, int err),
+    TP_ARGS(dir, child, ino, pos, err),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __field(ino_t, ino)
+        __field(loff_t, pos)
+        __field(int, err)
+        __string(name, child->name)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = ino;
+        __entry->pos = pos;
+        __entry->err = err;
+        __assign_str(name, child->name);
+    ),
+
+    TP_printk("dev %d,%d dir %lu name %s ino %lu pos %lld err %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+        __get_str(name), (unsigned long)__entry->ino, __entry->pos, __entry->err)
+);
+
+TRACE_EVENT(bitsfs_delete_entry,
+    TP_PROTO(struct inode *dir, ino_t ino, loff_t pos, int err),
+    TP_ARGS(dir, ino, pos, err),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, dir)
+        __field(ino_t, ino)
+        __field(loff_t, pos)
+        __field(int, err)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = ino;
+        __entry->pos = pos;
+        __entry->err = err;
+    ),
+
+    TP_printk("dev %d,%d dir %lu ino %lu pos %lld err %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->dir,
+        (unsigned long)__entry->ino, __entry->pos, __entry->err)
+);
+
+DECLARE_EVENT_CLASS(bitsfs__inode,
+    TP_PROTO(struct super_block *sb, ino_t ino, int err),
+    TP_ARGS(sb, ino, err),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, ino)
+        __field(int, err)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->ino = ino;
+        __entry->err = err;
+    ),
+
+    TP_printk("dev %d,%d ino %lu err %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+        __entry->err)
+);
+
+DEFINE_EVENT(bitsfs__inode, bitsfs_iget,
+    TP_PROTO(struct super_block *sb, ino_t ino, int err),
+    TP_ARGS(sb, ino, err)
+);
+
+DEFINE_EVENT(bitsfs__inode, bitsfs_new_inode,
+    TP_PROTO(struct super_block *sb, ino_t ino, int err),
+    TP_ARGS(sb, ino, err)
+);
+
+DEFINE_EVENT(bitsfs__inode, bitsfs_free_inode,
+    TP_PROTO(struct super_block *sb, ino_t ino, int err),
+    TP_ARGS(sb, ino, err)
+);
+
+DEFINE_EVENT(bitsfs__inode, bitsfs_evict_inode,
+    TP_PROTO(struct super_block *sb, ino_t ino, int err),
+    TP_ARGS(sb, ino, err)
+);
+
+TRACE_EVENT(bitsfs_write_inode,
+    TP_PROTO(struct inode *inode, int changed, int sync, int err),
+    TP_ARGS(inode, changed, sync, err),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(ino_t, ino)
+        __field(int, changed)
+        __field(int, sync)
+        __field(int, err)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->changed = changed;
+        __entry->sync = sync;
+        __entry->err = err;
+    ),
+
+    TP_printk("dev %d,%d ino %lu changed %d sync %d err %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned long)__entry->ino,
+        __entry->changed, __entry->sync, __entry->err)
+);
+
+#endif /* _BITSFS_TRACE_H */
+
+/* out of the kernel tree, the header is found next to the sources */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE bitsfs_trace
+#include <trace/define_trace.h>
@@ -7,6 +7,7 @@
 #include <linux/namei.h>
 #include <linux/uio.h>
 #include <linux/dax.h>
+#include "bitsfs_trace.h"
 
 /*
  * Read the block bitmap
@@ -50,9 +51,6 @@ static int alloc_single_block(struct inode *inode, unsigned long *pos)
     int block_length = BITSFS_BLOCK_SIZE << 3;
     struct buffer_head *bh;
 
-    bitsfs_msg(inode->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "Alloc single block, ino=%lu", inode->i_ino);
-
     bh = read_block_bitmap(inode->i_sb, BITSFS_BLKBMP_BLOCK);
     *pos = bitsfs_find_next_zero_bit(bh->b_data, block_length, 0);
     if(*pos >= block_length) {
@@ -62,6 +60,7 @@ static int alloc_single_block(struct inode *inode, unsigned long *pos)
         goto fail;
     }
     bitsfs_set_bit(*pos, bh->b_data);
+    trace_bitsfs_alloc_blocks(inode, *pos + BITSFS_DATA_BLOCK, 1);
 fail:
     brelse(bh);
     return err;
@@ -100,9 +99,6 @@ static int alloc_batch_blocks(struct inode *inode, int count, unsigned long *pos
     unsigned long start, end;
     struct buffer_head *bh;
 
-    bitsfs_msg(inode->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "Alloc batch blocks, ino=%lu, count=%d", inode->i_ino, count);
-
     bh = read_block_bitmap(inode->i_sb, BITSFS_BLKBMP_BLOCK);
     err = find_avai_block_range(bh, count, 0, &start, &end);
     if(err) {
@@ -111,13 +107,135 @@ static int alloc_batch_blocks(struct inode *inode, int count, unsigned long *pos
         goto fail;
     }
     *pos = start;
-    for (;start < end; ++start) 
+    for (end = start + count; start < end; ++start)
         bitsfs_set_bit(start, bh->b_data);
+    trace_bitsfs_alloc_blocks(inode, *pos + BITSFS_DATA_BLOCK, count);
 fail:
     brelse(bh);
     return err;
 }
 
+/*
+ * Fill the direct slots of a growing directory from `n' on with one
+ * contiguous run, placed right after its previous block when there is room.
+ * The run doubles with every call up to BITSFS_DIR_PREALLOC_MAX, so a big
+ * directory reads its first pages sequentially. Slots past i_size are used
+ * as the directory grows and freed with it by __bitsfs_truncate_blocks().
+ */
+static int bitsfs_dir_prealloc(struct inode *inode, int n)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(inode);
+    unsigned long goal = 0, start, end;
+    unsigned int count, i;
+    struct buffer_head *bh;
+    int err;
+
+    count = bi->i_dir_prealloc ? min_t(unsigned int, bi->i_dir_prealloc * 2, BITSFS_DIR_PREALLOC_MAX) : 1;
+    for (i = 1; i < count && n + i < BITSFS_DDIR_BLOCKS && !bi->i_data[n + i]; i++)
+        ;
+    count = i;
+    if (n)
+        goal = bi->i_data[n - 1] + 1 - BITSFS_DATA_BLOCK;
+
+    bh = read_block_bitmap(inode->i_sb, BITSFS_BLKBMP_BLOCK);
+    if (!bh)
+        return -EIO;
+
+    /* after the previous block, else the first run that fits, else one block */
+    err = find_avai_block_range(bh, count, goal, &start, &end);
+    if (err)
+        err = find_avai_block_range(bh, count, 0, &start, &end);
+    if (err && count > 1) {
+        count = 1;
+        err = find_avai_block_range(bh, count, 0, &start, &end);
+    }
+    if (err) {
+        brelse(bh);
+        bitsfs_msg(inode->i_sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "No blocks for directory, ino=%lu", inode->i_ino);
+        return -ENOSPC;
+    }
+
+    for (i = 0; i < count; i++) {
+        bitsfs_set_bit(start + i, bh->b_data);
+        bi->i_data[n + i] = start + i + BITSFS_DATA_BLOCK;
+    }
+    mark_buffer_dirty(bh);
+    brelse(bh);
+
+    bi->i_dir_prealloc = count;
+    mark_inode_dirty(inode);
+
+    trace_bitsfs_alloc_blocks(inode, start + BITSFS_DATA_BLOCK, count);
+    return 0;
+}
+
+/*
+ * Allocate `count' contiguous blocks, return the first block number
+ */
+int bitsfs_new_blocks(struct inode *inode, int count, unsigned long *block)
+{
+    int err;
+    unsigned long pos;
+    struct buffer_head *bh;
+
+    err = alloc_batch_blocks(inode, count, &pos);
+    if (err)
+        return -ENOSPC;
+
+    bh = read_block_bitmap(inode->i_sb, BITSFS_BLKBMP_BLOCK);
+    if (bh) {
+        mark_buffer_dirty(bh);
+        brelse(bh);
+    }
+    *block = pos + BITSFS_DATA_BLOCK;
+    return 0;
+}
+
+/*
+ * Release `count' contiguous blocks starting at `block'
+ */
+void bitsfs_free_blocks(struct inode *inode, unsigned long block, int count)
+{
+    struct super_block *sb = inode->i_sb;
+    struct buffer_head *bh;
+    unsigned long pos;
+
+    if (block < BITSFS_DATA_BLOCK) {
+        bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Free blocks in system zone, ino=%lu block=%lu", inode->i_ino, block);
+        return;
+    }
+    trace_bitsfs_free_blocks(inode, block, count);
+
+    bh = read_block_bitmap(sb, BITSFS_BLKBMP_BLOCK);
+    if (!bh)
+        return;
+    for (pos = block - BITSFS_DATA_BLOCK; count > 0; ++pos, --count) {
+        if (!bitsfs_clear_bit(pos, bh->b_data))
+            bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                    "Bit already cleared for block %lu", pos + BITSFS_DATA_BLOCK);
+    }
+    mark_buffer_dirty(bh);
+    brelse(bh);
+}
+
+/*
+ * Write the block bitmap and wait for it
+ */
+int bitsfs_sync_block_bitmap(struct super_block *sb)
+{
+    struct buffer_head *bh;
+    int err;
+
+    bh = read_block_bitmap(sb, BITSFS_BLKBMP_BLOCK);
+    if (!bh)
+        return -EIO;
+    err = sync_dirty_buffer(bh);
+    brelse(bh);
+    return err;
+}
+
 int bitsfs_get_block(struct inode *inode, sector_t iblock,
         struct buffer_head *bh_result, int create)
 {
@@ -132,8 +250,18 @@ int bitsfs_get_block(struct inode *inode, sector_t iblock,
     if (iblock + 1 <= BITSFS_DDIR_BLOCKS) {
         pos = iblock;
         block_cnt = iblock + 1;
-        for (n = 0;n <= pos; ++n) {
+        /* a read maps what is there, holes stay unmapped */
+        if (!create && !bi->i_data[pos])
+            return 0;
+        for (n = 0; create && n <= pos; ++n) {
             if (!bi->i_data[n]) {
+                if (S_ISDIR(inode->i_mode)) {
+                    err = bitsfs_dir_prealloc(inode, n);
+                    if (err)
+                        goto fail;
+                    new = true;
+                    continue;
+                }
                 err = alloc_single_block(inode, &block_no);
                 if (err)
                     goto fail;
@@ -145,7 +273,7 @@ int bitsfs_get_block(struct inode *inode, sector_t iblock,
         pos = iblock + 1 - BITSFS_DDIR_BLOCKS;
         pos = (pos % BITSFS_NDIR_BLOCK_COUNT == 0) ? (pos / BITSFS_NDIR_BLOCK_COUNT) : (pos / BITSFS_NDIR_BLOCK_COUNT + 1);
         pos += (BITSFS_DDIR_BLOCKS - 1);
-        offset = pos % BITSFS_NDIR_BLOCK_COUNT;
+        offset = (iblock - BITSFS_DDIR_BLOCKS) % BITSFS_NDIR_BLOCK_COUNT;
         block_cnt = BITSFS_DDIR_BLOCKS;
 
         /* Exceed supported max block size */
@@ -154,9 +282,11 @@ int bitsfs_get_block(struct inode *inode, sector_t iblock,
                     "warning: iblock is too big, iblock=%lu", iblock);
             return -EIO;
         }
+        if (!create && !bi->i_data[pos])
+            return 0;
 
         /* Alloc 1st level blocks */
-        for (n = 0;n < BITSFS_DDIR_BLOCKS; ++n) {
+        for (n = 0; create && n < BITSFS_DDIR_BLOCKS; ++n) {
             if (!bi->i_data[n]) {
                 err = alloc_single_block(inode, &block_no);
                 if (err)
@@ -167,7 +297,7 @@ int bitsfs_get_block(struct inode *inode, sector_t iblock,
         }
 
         /* Alloc 2nd level blocks, batch size: 1024 */
-        for (n = BITSFS_DDIR_BLOCKS;n <= pos; ++n) {
+        for (n = BITSFS_DDIR_BLOCKS; create && n <= pos; ++n) {
             if (!bi->i_data[n]) {
                 err = alloc_batch_blocks(inode, BITSFS_NDIR_BLOCK_COUNT, &block_no) ;
                 if (err)
@@ -180,14 +310,20 @@ int bitsfs_get_block(struct inode *inode, sector_t iblock,
     }
 
     blk_no = bi->i_data[pos] + offset;
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_get_block, iblock=%lu create=%d pos=%d offset=%d blk_no=%lu block_cnt=%lu block_bits=%d", 
-            iblock, create, pos, offset, blk_no, block_cnt, inode->i_blkbits);
-
     map_bh(bh_result, sb, blk_no);
-    bh_result->b_size = (block_cnt << inode->i_blkbits);
+    /* the rest of an extent is contiguous, direct blocks where they follow each other */
+    if (pos < BITSFS_DDIR_BLOCKS) {
+        for (block_cnt = 1; pos + block_cnt < BITSFS_DDIR_BLOCKS; ++block_cnt) {
+            if (bi->i_data[pos + block_cnt] != blk_no + block_cnt)
+                break;
+        }
+    } else {
+        block_cnt = BITSFS_NDIR_BLOCK_COUNT - offset;
+    }
+    bh_result->b_size = min_t(size_t, bh_result->b_size, block_cnt << inode->i_blkbits);
     if (new)
         set_buffer_new(bh_result);
+    trace_bitsfs_get_block(inode, iblock, blk_no, bh_result->b_size, create, new);
     //set_buffer_boundary(bh_result);
     return 0;
 fail:
@@ -196,27 +332,51 @@ fail:
     return err;
 }
 
-void __bitsfs_truncate_blocks(struct inode *inode)
+/*
+ * Whether a truncate to `offset' has blocks to free
+ */
+static int bitsfs_blocks_past(struct inode *inode, loff_t offset)
 {
-    int n, k;
-    struct super_block *sb = inode->i_sb;
+    int n;
+    sector_t first, start;
     struct bitsfs_inode_info *bi = BITSFS_I2BI(inode);
-    struct buffer_head *bh;
 
-    bh = read_block_bitmap(sb, BITSFS_BLKBMP_BLOCK);
+    first = (offset + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits;
+    for (n = 0; n < BITSFS_TMAX_BLOCKS; ++n) {
+        if (n < BITSFS_DDIR_BLOCKS)
+            start = n;
+        else
+            start = BITSFS_DDIR_BLOCKS + (n - BITSFS_DDIR_BLOCKS) * BITSFS_NDIR_BLOCK_COUNT;
+        if (start >= first && bi->i_data[n])
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Free the direct blocks and the whole extents that lie past `offset'
+ */
+void __bitsfs_truncate_blocks(struct inode *inode, loff_t offset)
+{
+    int n;
+    sector_t first, start;
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(inode);
+
+    first = (offset + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits;
     for (n = 0;n < BITSFS_DDIR_BLOCKS; ++n) {
-        if (!bi->i_data[n]) {
-            bitsfs_clear_bit(bi->i_data[n], bh->b_data);
+        if (n >= first && bi->i_data[n]) {
+            bitsfs_free_blocks(inode, bi->i_data[n], 1);
+            bi->i_data[n] = 0;
         }
     }
 
     for (;n < BITSFS_TMAX_BLOCKS; ++n) {
-        if (!bi->i_data[n]) {
-            for (k = 0; k < BITSFS_NDIR_BLOCK_COUNT; ++k)
-                bitsfs_clear_bit(bi->i_data[n] + k, bh->b_data);
+        start = BITSFS_DDIR_BLOCKS + (n - BITSFS_DDIR_BLOCKS) * BITSFS_NDIR_BLOCK_COUNT;
+        if (start >= first && bi->i_data[n]) {
+            bitsfs_free_blocks(inode, bi->i_data[n], BITSFS_NDIR_BLOCK_COUNT);
+            bi->i_data[n] = 0;
         }
     }
-    brelse(bh);
 }
 
 
@@ -229,7 +389,16 @@ void bitsfs_truncate_blocks(struct inode *inode, loff_t offset)
 	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
 	    S_ISLNK(inode->i_mode)))
 		return;
-	__bitsfs_truncate_blocks(inode);
+	/* a crash halfway leaves it to bitsfs_orphan_cleanup() */
+	if (inode->i_nlink && bitsfs_blocks_past(inode, offset)) {
+		bitsfs_orphan_add(inode);
+		bitsfs_orphan_sync(inode);
+	}
+	__bitsfs_truncate_blocks(inode, offset);
+	if (inode->i_nlink) {
+		mark_inode_dirty(inode);
+		bitsfs_orphan_del(inode);
+	}
 }
 
 static void bitsfs_write_failed(struct address_space *mapping, loff_t to)
@@ -243,6 +412,8 @@ static void bitsfs_write_failed(struct address_space *mapping, loff_t to)
 
 static int bitsfs_readpage(struct file *file, struct page *page)
 {
+    if (bitsfs_has_inline_data(page->mapping->host))
+        return bitsfs_read_inline_page(page->mapping->host, page);
     return mpage_readpage(page, bitsfs_get_block);
 }
 
@@ -253,6 +424,9 @@ static int bitsfs_writepage(struct page *page, struct writeback_control *wbc)
 
 static void bitsfs_readahead(struct readahead_control *rac)
 {
+    /* left to readpage, an inline directory has no blocks to read */
+    if (bitsfs_has_inline_data(rac->mapping->host))
+        return;
     mpage_readahead(rac, bitsfs_get_block);
 }
 
@@ -281,6 +455,9 @@ static int bitsfs_write_end(struct file *file, struct address_space *mapping,
 
 static sector_t bitsfs_bmap(struct address_space *mapping, sector_t block)
 {
+    /* the data is in the inode */
+    if (bitsfs_has_inline_data(mapping->host))
+        return 0;
     return generic_block_bmap(mapping,block,bitsfs_get_block);
 }
 
@@ -293,6 +470,9 @@ static ssize_t bitsfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
     size_t count = iov_iter_count(iter);
     loff_t offset = iocb->ki_pos;
 
+    /* no blocks to go to, 0 falls back to buffered I/O */
+    if (bitsfs_has_inline_data(inode))
+        return 0;
     ret = blockdev_direct_IO(iocb, inode, iter, bitsfs_get_block);
     if (ret < 0 && iov_iter_rw(iter) == WRITE)
         bitsfs_write_failed(mapping, offset + count);
@@ -0,0 +1,166 @@
+#include "bitsfs.h"
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/uaccess.h>
+
+/*
+ * Bulkstat, BITSFS_IOC_BULKSTAT
+ *
+ * Reports the attributes of the allocated inodes of the volume in inode
+ * number order from br_ino on, like XFS bulkstat. The inode bitmaps pick
+ * the allocated inodes and the table blocks holding them are read in order
+ * with a readahead window of BITSFS_BULKSTAT_RA blocks, so a scan of the
+ * whole volume is sequential I/O instead of a bitsfs_iget() per file.
+ * Inodes in the inode cache answer from memory, which may be newer than
+ * their table block.
+ */
+
+#define BITSFS_BULKSTAT_MAX     1024   /* Records per call */
+#define BITSFS_BULKSTAT_RA      64     /* Table blocks read ahead */
+
+static void bitsfs_bstat_inode(struct bitsfs_bstat *bs, struct inode *inode)
+{
+    bs->bs_mode = inode->i_mode;
+    bs->bs_nlink = inode->i_nlink;
+    bs->bs_uid = i_uid_read(inode);
+    bs->bs_gid = i_gid_read(inode);
+    bs->bs_size = i_size_read(inode);
+    bs->bs_blocks = inode->i_blocks;
+    bs->bs_flags = BITSFS_I2BI(inode)->i_flags & BITSFS_FL_USER_VISIBLE;
+    bs->bs_atime = inode->i_atime.tv_sec;
+    bs->bs_atime_nsec = inode->i_atime.tv_nsec;
+    bs->bs_mtime = inode->i_mtime.tv_sec;
+    bs->bs_mtime_nsec = inode->i_mtime.tv_nsec;
+    bs->bs_ctime = inode->i_ctime.tv_sec;
+    bs->bs_ctime_nsec = inode->i_ctime.tv_nsec;
+}
+
+static void bitsfs_bstat_raw(struct super_block *sb, struct bitsfs_bstat *bs,
+        struct bitsfs_inode *raw_inode)
+{
+    struct bitsfs_inode_extra *ext = bitsfs_inode_extra(sb, raw_inode);
+    struct timespec64 ts;
+
+    bs->bs_mode = le16_to_cpu(raw_inode->i_mode);
+    bs->bs_nlink = le16_to_cpu(raw_inode->i_links_count);
+    bs->bs_uid = le16_to_cpu(raw_inode->i_uid);
+    bs->bs_gid = le16_to_cpu(raw_inode->i_gid);
+    bs->bs_size = le32_to_cpu(raw_inode->i_size);
+    bs->bs_blocks = le32_to_cpu(raw_inode->i_blocks);
+    bs->bs_flags = le32_to_cpu(raw_inode->i_flags) & BITSFS_FL_USER_VISIBLE;
+    bitsfs_decode_time(&ts, raw_inode->i_atime,
+            ext ? &ext->i_atime_hi : NULL, ext ? &ext->i_atime_nsec : NULL);
+    bs->bs_atime = ts.tv_sec;
+    bs->bs_atime_nsec = ts.tv_nsec;
+    bitsfs_decode_time(&ts, raw_inode->i_mtime,
+            ext ? &ext->i_mtime_hi : NULL, ext ? &ext->i_mtime_nsec : NULL);
+    bs->bs_mtime = ts.tv_sec;
+    bs->bs_mtime_nsec = ts.tv_nsec;
+    bitsfs_decode_time(&ts, raw_inode->i_ctime,
+            ext ? &ext->i_ctime_hi : NULL, ext ? &ext->i_ctime_nsec : NULL);
+    bs->bs_ctime = ts.tv_sec;
+    bs->bs_ctime_nsec = ts.tv_nsec;
+}
+
+/*
+ * Start reading the table blocks of the inodes from `ino' on
+ */
+static unsigned long bitsfs_bulkstat_ra(struct super_block *sb, unsigned long ino,
+        unsigned long inodes)
+{
+    unsigned long per_block = BITSFS_BLOCK_SIZE / BITFS_S2SI(sb)->s_inode_size;
+    unsigned long offset, n;
+    struct blk_plug plug;
+
+    /* from the first inode of its block */
+    ino -= (ino - 1) % per_block;
+    blk_start_plug(&plug);
+    for (n = 0; n < BITSFS_BULKSTAT_RA && ino <= inodes; n++, ino += per_block)
+        bitsfs_itable_readahead(sb, bitsfs_inode_block(sb, ino, &offset));
+    blk_finish_plug(&plug);
+    return ino;
+}
+
+int bitsfs_bulkstat(struct super_block *sb, struct bitsfs_bulkstat *br)
+{
+    unsigned long inodes = le32_to_cpu(BITFS_S2SI(sb)->s_bs->s_inodes_count);
+    unsigned long ino = max_t(u64, br->br_ino, BITSFS_ROOT_INO);
+    unsigned long k, bit, end, block, offset, ra_next = 0, bitmap_k = 0;
+    unsigned int max = min_t(u32, br->br_count, BITSFS_BULKSTAT_MAX);
+    struct buffer_head *bitmap_bh = NULL, *bh = NULL;
+    struct bitsfs_bstat *buf, *bs;
+    struct inode *inode;
+    unsigned int nr = 0;
+    int err = 0;
+
+    buf = kvmalloc_array(max, sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    while (ino <= inodes && nr < max) {
+        k = (ino - 1) / BITSFS_INODES_PER_BITMAP;
+        if (!bitmap_bh || k != bitmap_k) {
+            brelse(bitmap_bh);
+            bitmap_bh = read_inode_bitmap(sb, k);
+            if (!bitmap_bh) {
+                err = -EIO;
+                break;
+            }
+            bitmap_k = k;
+        }
+
+        /* on to the next allocated inode */
+        end = min_t(unsigned long, inodes - k * BITSFS_INODES_PER_BITMAP,
+                BITSFS_INODES_PER_BITMAP);
+        bit = bitsfs_find_next_bit(bitmap_bh->b_data, end, (ino - 1) % BITSFS_INODES_PER_BITMAP);
+        ino = k * BITSFS_INODES_PER_BITMAP + bit + 1;
+        if (bit >= end)
+            continue;
+
+        if (ino >= ra_next)
+            ra_next = bitsfs_bulkstat_ra(sb, ino, inodes);
+
+        bs = &buf[nr];
+        memset(bs, 0, sizeof(*bs));
+        bs->bs_ino = ino;
+
+        rcu_read_lock();
+        inode = find_inode_by_ino_rcu(sb, ino);
+        if (inode && !(READ_ONCE(inode->i_state) & (I_NEW | I_FREEING))) {
+            bitsfs_bstat_inode(bs, inode);
+            rcu_read_unlock();
+        } else {
+            rcu_read_unlock();
+            block = bitsfs_inode_block(sb, ino, &offset);
+            if (!bh || bh->b_blocknr != block) {
+                brelse(bh);
+                bh = bitsfs_itable_bread(sb, block);
+                if (!bh) {
+                    err = -EIO;
+                    break;
+                }
+            }
+            bitsfs_bstat_raw(sb, bs, (struct bitsfs_inode *)(bh->b_data + offset));
+        }
+        /* a bit set ahead of the inode being written */
+        if (bs->bs_mode)
+            nr++;
+        ino++;
+    }
+    brelse(bh);
+    brelse(bitmap_bh);
+
+    if (!err && nr && copy_to_user(u64_to_user_ptr(br->br_buf), buf, nr * sizeof(*buf)))
+        err = -EFAULT;
+    if (!err) {
+        br->br_ocount = nr;
+        br->br_ino = ino;
+    }
+    kvfree(buf);
+
+    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Bulkstat, count=%u next=%lu err=%d", nr, ino, err);
+    return err;
+}
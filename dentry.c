@@ -3,12 +3,13 @@
 #include <linux/pagemap.h>
 #include <linux/swap.h>
 #include <linux/iversion.h>
+#include "bitsfs_trace.h"
 
 typedef struct bitsfs_dir_entry bitsfs_dirent;
 
 static inline int bitsfs_name_match (int len, const char * const name, bitsfs_dirent *de)
 {
-    if (!de->inode)
+    if (!de->inode || de->name_len != len)
         return 0;
     return !memcmp(name, de->name, len);
 }
@@ -37,6 +38,9 @@ static unsigned bitsfs_last_byte(struct inode *inode, unsigned long page_nr)
 
 static int bitsfs_prepare_chunk(struct page *page, loff_t pos, unsigned len)
 {
+    /* page 0 of an inline directory comes from the inode, see inline.c */
+    if (bitsfs_has_inline_data(page->mapping->host))
+        return 0;
     return __block_write_begin(page, pos, len, bitsfs_get_block);
 }
 
@@ -47,20 +51,26 @@ static int bitsfs_commit_chunk(struct page *page, loff_t pos, unsigned len)
     int err = 0;
 
     inode_inc_iversion(dir);
-    block_write_end(NULL, mapping, pos, len, len, page, NULL);
+    if (bitsfs_has_inline_data(dir)) {
+        /* into the inode, unless the entries outgrow it now */
+        err = bitsfs_write_inline_page(dir, page);
+        if (err) {
+            unlock_page(page);
+            return err;
+        }
+    }
+    if (!bitsfs_has_inline_data(dir))
+        block_write_end(NULL, mapping, pos, len, len, page, NULL);
 
     if (pos+len > dir->i_size) {
         i_size_write(dir, pos+len);
         mark_inode_dirty(dir);
     }
 
-    if (IS_DIRSYNC(dir)) {
-        err = write_one_page(page);
-        if (!err)
-            err = sync_inode_metadata(dir, 1);
-    } else {
-        unlock_page(page);
-    }
+    unlock_page(page);
+    /* with other directory updates at the same time, see dirsync.c */
+    if (IS_DIRSYNC(dir))
+        err = bitsfs_dirsync(dir);
 
     return err;
 }
@@ -72,22 +82,14 @@ static int bitsfs_commit_chunk(struct page *page, loff_t pos, unsigned len)
  * NOTE: bitsfs_find_entry() and bitsfs_dotdot() act as a call to bitsfs_get_page()
  * and should be treated as a call to bitsfs_get_page() for nesting purposes.
  */
-static struct page * bitsfs_get_page(struct inode *dir, unsigned long n,
+struct page * bitsfs_get_page(struct inode *dir, unsigned long n,
                    int quiet, void **page_addr)
 {
     struct address_space *mapping;
     struct page *page;
     mapping = dir->i_mapping;
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_get_page start, ino=%lu, page_no=%lu, mapping=%p,  nrpages=%lu", 
-            dir->i_ino, n, mapping, mapping->nrpages);
-
     page = read_mapping_page(mapping, n, NULL);
-
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_get_page end, page=%d", page);
-    
     if (!IS_ERR(page)) {
         *page_addr = kmap_local_page(page);
         /*if (unlikely(!PageChecked(page))) {
@@ -102,6 +104,30 @@ fail:
     return ERR_PTR(-EIO);
 }
 
+/*
+ * Read ahead directory pages [n, end) for a scan: a synchronous window when
+ * page `n' is not cached, the next window when the scan reaches the marker
+ * of the last one. Runs of blocks map as single bios, see bitsfs_get_block().
+ */
+void bitsfs_dir_readahead(struct inode *dir, struct file_ra_state *ra,
+            struct file *file, unsigned long n, unsigned long end)
+{
+    struct address_space *mapping = dir->i_mapping;
+    struct page *page;
+
+    if (n >= end)
+        return;
+
+    page = find_get_page(mapping, n);
+    if (!page) {
+        page_cache_sync_readahead(mapping, ra, file, n, end - n);
+        return;
+    }
+    if (PageReadahead(page))
+        page_cache_async_readahead(mapping, ra, file, page, n, end - n);
+    put_page(page);
+}
+
 static inline unsigned bitsfs_validate_entry(char *base, unsigned offset, unsigned mask)
 {
     bitsfs_dirent *de = (bitsfs_dirent*)(base + offset);
@@ -109,21 +135,302 @@ static inline unsigned bitsfs_validate_entry(char *base, unsigned offset, unsign
     while ((char*)p < (char*)de) {
         if (p->rec_len == 0)
             break;
-        p = (bitsfs_dirent*)((char*)p + DENT_LEN);
+        p = bitsfs_next_entry(p);
     }
     return (char *)p - base;
 }
 
 static inline void bitsfs_set_de_type(bitsfs_dirent *de, struct inode *inode)
 {
-    /* TODO */
-    // de->file_type = fs_umode_to_ftype(inode->i_mode);
+    de->file_type = fs_umode_to_ftype(inode->i_mode);
+}
+
+/*
+ * Return the live entry named `child' at byte offset `pos' with its page
+ * mapped, or NULL when the entry there has another name
+ */
+bitsfs_dirent *bitsfs_entry_at(struct inode *dir, loff_t pos,
+            const struct qstr *child, struct page **res_page,
+            void **res_page_addr)
+{
+    bitsfs_dirent *de;
+    struct page *page;
+    void *page_addr;
+    unsigned offset = pos & ~PAGE_MASK;
+
+    if (pos + bitsfs_dent_used(dir->i_sb, child->len) > dir->i_size ||
+            offset & BITSFS_DIR_ROUND)
+        return NULL;
+
+    page = bitsfs_get_page(dir, pos >> PAGE_SHIFT, 0, &page_addr);
+    if (IS_ERR(page))
+        return ERR_CAST(page);
+
+    de = (bitsfs_dirent *)((char *)page_addr + offset);
+    if (de->inode && de->name_len == child->len &&
+            !memcmp(de->name, child->name, child->len)) {
+        *res_page = page;
+        *res_page_addr = page_addr;
+        return de;
+    }
+    bitsfs_put_page(page, page_addr);
+    return NULL;
+}
+
+/*
+ * Free-slot map
+ *
+ * bitsfs_delete_entry() only clears de->inode, leaving a hole that keeps its
+ * rec_len (with vardent the space goes to the entry before it instead).
+ * i_dir_holes counts those holes and is saved in the disk inode, so a
+ * directory without holes never pays for the map. The map itself is one bit
+ * per page with room for an entry and is built by a single scan on the first
+ * insert that needs it. All updates run under the directory i_rwsem.
+ */
+
+/*
+ * Bytes a new entry could take over in `de'
+ */
+static inline unsigned bitsfs_room(struct inode *dir, bitsfs_dirent *de)
+{
+    unsigned rec_len = le16_to_cpu(de->rec_len);
+
+    if (!de->inode)
+        return rec_len;
+    if (bitsfs_vardent(dir->i_sb))
+        return rec_len - bitsfs_dent_used(dir->i_sb, de->name_len);
+    return 0;
+}
+
+/*
+ * Return the first entry in page `n' after `from' with `need' bytes of room,
+ * or NULL
+ */
+static bitsfs_dirent *bitsfs_next_hole(struct inode *dir, unsigned long n,
+            void *page_addr, bitsfs_dirent *from, unsigned need)
+{
+    bitsfs_dirent *de = from ? bitsfs_next_entry(from) : (bitsfs_dirent *)page_addr;
+    char *limit = (char *)page_addr + bitsfs_last_byte(dir, n);
+
+    for (; (char *)de < limit && de->rec_len; de = bitsfs_next_entry(de)) {
+        if (bitsfs_room(dir, de) >= need)
+            return de;
+    }
+    return NULL;
+}
+
+static int bitsfs_dir_holes_load(struct inode *dir)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    unsigned long n, npages = dir_pages(dir);
+    unsigned long *map;
+    unsigned need = bitsfs_dent_used(dir->i_sb, 1);
+    __u32 holes = 0;
+    struct file_ra_state ra;
+
+    if (bi->i_dir_holemap)
+        return 0;
+
+    map = kvzalloc(BITS_TO_LONGS(BITSFS_MAX_DIR_PAGES) * sizeof(long), GFP_NOFS);
+    if (!map)
+        return -ENOMEM;
+
+    file_ra_state_init(&ra, dir->i_mapping);
+    for (n = 0; n < npages; n++) {
+        void *page_addr;
+        struct page *page;
+        bitsfs_dirent *de = NULL;
+
+        bitsfs_dir_readahead(dir, &ra, NULL, n, npages);
+        page = bitsfs_get_page(dir, n, 0, &page_addr);
+        if (IS_ERR(page)) {
+            kvfree(map);
+            return PTR_ERR(page);
+        }
+        while ((de = bitsfs_next_hole(dir, n, page_addr, de, need)) != NULL) {
+            __set_bit(n, map);
+            holes++;
+        }
+        bitsfs_put_page(page, page_addr);
+    }
+
+    /* the saved count may lag behind an image written before it existed */
+    if (bi->i_dir_holes != holes) {
+        bi->i_dir_holes = holes;
+        mark_inode_dirty(dir);
+    }
+    bi->i_dir_holemap = map;
+    return 0;
+}
+
+void bitsfs_dir_holes_drop(struct inode *dir)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+
+    kvfree(bi->i_dir_holemap);
+    bi->i_dir_holemap = NULL;
+}
+
+/*
+ * Take a hole with `need' bytes of room from the free-slot map. Returns it
+ * with its page mapped and locked, NULL when there is none (or the map
+ * cannot be built). A page without such room leaves the map, so with
+ * vardent a long name may cost a short name the remaining room there.
+ */
+static bitsfs_dirent *bitsfs_take_hole(struct inode *dir, unsigned need,
+            struct page **res_page, void **res_page_addr)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    unsigned long n, npages = dir_pages(dir);
+
+    if (!bi->i_dir_holes || bitsfs_dir_holes_load(dir))
+        return NULL;
+
+    while ((n = find_first_bit(bi->i_dir_holemap, npages)) < npages) {
+        void *page_addr;
+        struct page *page = bitsfs_get_page(dir, n, 0, &page_addr);
+        bitsfs_dirent *de;
+
+        if (IS_ERR(page))
+            return ERR_CAST(page);
+
+        lock_page(page);
+        de = bitsfs_next_hole(dir, n, page_addr, NULL, need);
+        if (de) {
+            *res_page = page;
+            *res_page_addr = page_addr;
+            return de;
+        }
+        unlock_page(page);
+        bitsfs_put_page(page, page_addr);
+        __clear_bit(n, bi->i_dir_holemap);
+    }
+    bi->i_dir_holes = 0;
+    return NULL;
+}
+
+/*
+ * A hole in page `n' has just been reused
+ */
+static void bitsfs_fill_hole(struct inode *dir, unsigned long n, void *page_addr)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+
+    if (bi->i_dir_holes)
+        bi->i_dir_holes--;
+    if (bi->i_dir_holemap &&
+            !bitsfs_next_hole(dir, n, page_addr, NULL, bitsfs_dent_used(dir->i_sb, 1)))
+        __clear_bit(n, bi->i_dir_holemap);
+}
+
+/*
+ * Write a new entry into `de', which has room for it, splitting the unused
+ * tail off a live entry first. The page comes locked and is unlocked on
+ * return. Returns the position of the new entry.
+ */
+static loff_t bitsfs_insert_entry(struct inode *dir, struct page *page,
+            void *page_addr, bitsfs_dirent *de, const char *name, int len,
+            __le32 ino, __u8 file_type)
+{
+    loff_t pos = page_offset(page) + (char *)de - (char *)page_addr;
+    loff_t new_pos;
+    unsigned rec_len = bitsfs_vardent(dir->i_sb) ? le16_to_cpu(de->rec_len) : DENT_LEN;
+    int err;
+
+    err = bitsfs_prepare_chunk(page, pos, rec_len);
+    if (err) {
+        unlock_page(page);
+        return err;
+    }
+
+    if (de->inode) {
+        unsigned used = bitsfs_dent_used(dir->i_sb, de->name_len);
+        bitsfs_dirent *de1 = (bitsfs_dirent *)((char *)de + used);
+
+        de1->rec_len = cpu_to_le16(rec_len - used);
+        de->rec_len = cpu_to_le16(used);
+        de = de1;
+    }
+
+    /* construct dentry */
+    de->inode     = ino;
+    de->name_len  = len;
+    de->file_type = file_type;
+    memcpy(de->name, name, len);
+    if (!bitsfs_vardent(dir->i_sb))
+        de->rec_len = cpu_to_le16(DENT_LEN);
+    if (bitsfs_dirhash(dir->i_sb))
+        *bitsfs_dent_hash(dir->i_sb, de) = cpu_to_le32(bitsfs_name_hash(name, len));
+    new_pos = page_offset(page) + (char *)de - (char *)page_addr;
+
+    err = bitsfs_commit_chunk(page, pos, rec_len);
+    return err ? err : new_pos;
+}
+
+/*
+ * Find an entry without scanning the directory: the name cache first, then
+ * the on-disk index. NULL means neither can answer.
+ */
+static bitsfs_dirent *bitsfs_fast_find_entry(struct inode *dir,
+            const struct qstr *child, struct page **res_page,
+            void **res_page_addr)
+{
+    bitsfs_dirent *de;
+
+    de = bitsfs_dcache_find(dir, child, res_page, res_page_addr);
+    if (!de)
+        de = bitsfs_dx_find_entry(dir, child, res_page, res_page_addr);
+    return de;
+}
+
+/*
+ * Scan the page at `page_addr' up to `limit' for `child' by the hashes the
+ * dirhash feature stores in the entries. Fixed size entries put them at a
+ * 64 byte stride, so four are tested per branch; the name is only compared
+ * on a hash hit. Kernel SIMD would need kernel_fpu_begin() per page, which
+ * costs more than it saves on 64 words.
+ */
+static bitsfs_dirent *bitsfs_hash_scan(struct inode *dir, char *page_addr,
+            char *limit, const struct qstr *child, __le32 hash)
+{
+    struct super_block *sb = dir->i_sb;
+    bitsfs_dirent *de = (bitsfs_dirent *)page_addr;
+
+    if (bitsfs_vardent(sb)) {
+        for (; (char *)de < limit && de->rec_len; de = bitsfs_next_entry(de)) {
+            if (*bitsfs_dent_hash(sb, de) == hash &&
+                    bitsfs_name_match(child->len, child->name, de))
+                return de;
+        }
+        return NULL;
+    }
+
+    for (; (char *)de + 4 * DENT_LEN <= limit; de = (bitsfs_dirent *)((char *)de + 4 * DENT_LEN)) {
+        const __le32 *h = bitsfs_dent_hash(sb, de);
+        int i;
+
+        if (likely((h[0] != hash) & (h[DENT_LEN / 4] != hash) &
+                (h[2 * DENT_LEN / 4] != hash) & (h[3 * DENT_LEN / 4] != hash)))
+            continue;
+        for (i = 0; i < 4; i++) {
+            bitsfs_dirent *p = (bitsfs_dirent *)((char *)de + i * DENT_LEN);
+            if (h[i * DENT_LEN / 4] == hash &&
+                    bitsfs_name_match(child->len, child->name, p))
+                return p;
+        }
+    }
+    for (; (char *)de < limit; de = (bitsfs_dirent *)((char *)de + DENT_LEN)) {
+        if (*bitsfs_dent_hash(sb, de) == hash &&
+                bitsfs_name_match(child->len, child->name, de))
+            return de;
+    }
+    return NULL;
 }
 
 /*
  *    Find dentry by the specific name
  */
-bitsfs_dirent *bitsfs_find_entry(struct inode *dir,
+static bitsfs_dirent *__bitsfs_find_entry(struct inode *dir,
             const struct qstr *child, struct page **res_page,
             void **res_page_addr)
 {
@@ -132,9 +439,9 @@ bitsfs_dirent *bitsfs_find_entry(struct inode *dir,
     struct page *page = NULL;
     void *page_addr = NULL;
     bitsfs_dirent *de;
-
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_find_entry start, d_name=%s, npages=%lu", child->name, npages);
+    __le32 hash = 0;
+    struct file_ra_state ra;
+    int bloom;
 
     if (npages == 0)
         goto out;
@@ -143,17 +450,39 @@ bitsfs_dirent *bitsfs_find_entry(struct inode *dir,
     *res_page = NULL;
     *res_page_addr = NULL;
 
+    /* sorted, nothing to learn from the lookup */
+    if (bitsfs_sealed(dir->i_sb))
+        return bitsfs_sealed_find_entry(dir, child, res_page, res_page_addr);
+
+    /* names the filter has never seen are not there */
+    bloom = bitsfs_bloom_test(dir, child);
+    if (!bloom)
+        return ERR_PTR(-ENOENT);
+
+    /* cached or indexed directory, otherwise fall back to a linear scan */
+    de = bitsfs_fast_find_entry(dir, child, res_page, res_page_addr);
+    if (de) {
+        if (de == ERR_PTR(-ENOENT) && bloom > 0)
+            bitsfs_bloom_miss(dir, bloom);
+        return de;
+    }
+
+    if (bitsfs_dirhash(dir->i_sb))
+        hash = cpu_to_le32(bitsfs_name_hash(child->name, child->len));
+
     /* get the start lookup page */
-    start = BITSFS_I2BI(dir)->i_dir_start_lookup;
+    start = READ_ONCE(BITSFS_I2BI(dir)->i_dir_start_lookup);
     if (start >= npages)
         start = 0;
 
     /* loop all pages from  */
+    file_ra_state_init(&ra, dir->i_mapping);
     n = start;
     do {
         char *kaddr;
 
         /* get the n-th page*/
+        bitsfs_dir_readahead(dir, &ra, NULL, n, n < start ? start : npages);
         page = bitsfs_get_page(dir, n, 0, &page_addr);
         if (IS_ERR(page))
             return ERR_CAST(page);
@@ -162,30 +491,27 @@ bitsfs_dirent *bitsfs_find_entry(struct inode *dir,
         de = (bitsfs_dirent *)page_addr;
 
         /* point the end of page */
-        kaddr = (char*)page_addr + bitsfs_last_byte(dir, n) - DENT_LEN;
+        kaddr = (char*)page_addr + bitsfs_last_byte(dir, n);
 
-        bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_find_entry outer loop, page_addr=%p kaddr=%p", page_addr, kaddr);
+        if (bitsfs_dirhash(dir->i_sb)) {
+            de = bitsfs_hash_scan(dir, page_addr, kaddr, child, hash);
+            if (de)
+                goto found;
+            /* skip the per entry scan below */
+            de = (bitsfs_dirent *)kaddr;
+        }
 
-        while ((char*)de <= kaddr) {
-            bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-                    "bitsfs_find_entry inner loop, kaddr=%p de=%p name=%s name_len=%d rec_len=%d", 
-                    kaddr, de, de->name, de->name_len, de->rec_len);
-
-            /* goto out when dentry invalid */
-            if (de->rec_len == 0) {
-                bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__,
-                        "bitsfs_find_entry reach empty entry");
-                bitsfs_put_page(page, page_addr);
-                goto out;
-            }
+        while ((char*)de < kaddr) {
+            /* end of the entries, the pages before `start' are still to come */
+            if (de->rec_len == 0)
+                break;
 
             /* check name match */
             if (bitsfs_name_match(child->len, child->name, de))
                 goto found;
             
             /* step to next dentry */
-            de = (bitsfs_dirent *)((char *)de + DENT_LEN);
+            de = bitsfs_next_entry(de);
         }
 
         /* put old page */
@@ -195,19 +521,30 @@ bitsfs_dirent *bitsfs_find_entry(struct inode *dir,
         if (++n >= npages)
             n = 0;
     } while (n != start);
+
+    /* every page was scanned */
+    bitsfs_bloom_miss(dir, bloom);
 out:
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_find_entry not found");
     return ERR_PTR(-ENOENT);
 
 found:
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_find_entry found, res_page=%p res_page_addr=%lu", page, page_addr);
     *res_page = page;
     *res_page_addr = page_addr;
 
-    /* set dir_start-lookup*/
-    BITSFS_I2BI(dir)->i_dir_start_lookup = n;
+    /* set dir_start-lookup, parallel lookups share it so only store changes */
+    if (READ_ONCE(BITSFS_I2BI(dir)->i_dir_start_lookup) != n)
+        WRITE_ONCE(BITSFS_I2BI(dir)->i_dir_start_lookup, n);
+    return de;
+}
+
+bitsfs_dirent *bitsfs_find_entry(struct inode *dir,
+            const struct qstr *child, struct page **res_page,
+            void **res_page_addr)
+{
+    bitsfs_dirent *de = __bitsfs_find_entry(dir, child, res_page, res_page_addr);
+
+    trace_bitsfs_find_entry(dir, child, IS_ERR(de) ? 0 : le32_to_cpu(de->inode),
+            PTR_ERR_OR_ZERO(de));
     return de;
 }
 
@@ -221,7 +558,7 @@ bitsfs_dirent *bitsfs_dotdot(struct inode *dir, struct page **p, void **pa)
     bitsfs_dirent *de = NULL;
 
     if (!IS_ERR(page)) {
-        de = (bitsfs_dirent *)((char *)page_addr + DENT_LEN);
+        de = bitsfs_next_entry((bitsfs_dirent *)page_addr);
         *p = page;
         *pa = page_addr;
     }
@@ -233,9 +570,6 @@ int bitsfs_get_ino_by_name(struct inode *dir, const struct qstr *child, ino_t *i
     bitsfs_dirent *de;
     struct page *page;
     void *page_addr;
-    
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_get_ino_by_name start, d_name=%s", child->name);
 
     de = bitsfs_find_entry(dir, child, &page, &page_addr);
     if (IS_ERR(de))
@@ -253,21 +587,42 @@ void bitsfs_set_link(struct inode *dir, bitsfs_dirent *de,
     int err;
 
     loff_t pos = page_offset(page) + (char*)de - (char*)page_addr;
+    unsigned len = le16_to_cpu(de->rec_len);
     
     lock_page(page);
-    err = bitsfs_prepare_chunk(page, pos, DENT_LEN);
+    err = bitsfs_prepare_chunk(page, pos, len);
     BUG_ON(err);
     
     de->inode = cpu_to_le32(inode->i_ino);
     bitsfs_set_de_type(de, inode);
 
-    err = bitsfs_commit_chunk(page, pos, DENT_LEN);
+    err = bitsfs_commit_chunk(page, pos, len);
 
     if (update_times)
         dir->i_mtime = dir->i_ctime = current_time(dir);
     mark_inode_dirty(dir);
 }
 
+/*
+ * Keep the live entry count of a counted directory, the caller marks it dirty.
+ * A count that would go negative is wrong, the next bitsfs_empty_dir() then
+ * scans and counts again.
+ */
+static void bitsfs_dir_count(struct inode *dir, int delta)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+
+    if (!(bi->i_flags & BITSFS_DIRCOUNT_FL))
+        return;
+    if (delta < 0 && !bi->i_dir_entries) {
+        bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Directory entry count underflow, ino=%lu", dir->i_ino);
+        bi->i_flags &= ~BITSFS_DIRCOUNT_FL;
+        return;
+    }
+    bi->i_dir_entries += delta;
+}
+
 /*
  *    Add a dentry link to inode
  */
@@ -276,23 +631,41 @@ int bitsfs_add_link(struct dentry *dentry, struct inode *inode)
     struct inode *dir = d_inode(dentry->d_parent);
     const char *child_name = dentry->d_name.name;
     int child_len = dentry->d_name.len;
+    unsigned need = bitsfs_dent_used(dir->i_sb, child_len);
     
-    unsigned long n, npages = dir_pages(dir);
+    unsigned long n = 0, npages = dir_pages(dir);
     struct page *page = NULL;
     void *page_addr = NULL;
     
     int err;
-    loff_t pos;
+    int reuse = 0;
+    loff_t pos = -1, hole = -1;
     bitsfs_dirent * de;
+    struct file_ra_state ra;
+
+    /* cached or indexed directory: check duplicates by hash and go straight to the tail */
+    de = bitsfs_fast_find_entry(dir, &dentry->d_name, &page, &page_addr);
+    err = -EEXIST;
+    if (!IS_ERR_OR_NULL(de))
+        goto out_put;
+    if (de == ERR_PTR(-ENOENT)) {
+        /* no duplicate: reuse a deleted slot before growing the directory */
+        de = bitsfs_take_hole(dir, need, &page, &page_addr);
+        err = PTR_ERR(de);
+        if (IS_ERR(de))
+            goto out;
+        if (de)
+            goto got_hole;
+        if (npages)
+            n = npages - 1;
+    }
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-                    "bitsfs_add_link start, ino=%d child_name=%s", 
-                    inode->i_ino, child_name);
-
-    for (n = 0; n <= npages; n++) {
+    file_ra_state_init(&ra, dir->i_mapping);
+    for (; n <= npages; n++) {
         char *kaddr;
         char *dir_end;
 
+        bitsfs_dir_readahead(dir, &ra, NULL, n, npages);
         page = bitsfs_get_page(dir, n, 0, &page_addr);
         err = PTR_ERR(page);
         if (IS_ERR(page))
@@ -302,57 +675,72 @@ int bitsfs_add_link(struct dentry *dentry, struct inode *inode)
         de = (bitsfs_dirent*)page_addr;
         dir_end = (char*)page_addr + bitsfs_last_byte(dir, n);
 
-        kaddr = (char*)page_addr + PAGE_SIZE - DENT_LEN;
-        while ((char *)de <= kaddr) {
-
-            bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-                    "bitsfs_add_link loop, kaddr=%p dir_end=%p de=%p name=%s name_len=%d rec_len=%d", 
-                    kaddr, dir_end, de, de->name, de->name_len, de->rec_len);
-
+        kaddr = (char*)page_addr + PAGE_SIZE;
+        while ((char *)de < kaddr) {
             if ((char *)de == dir_end || de->rec_len == 0) {
+                if (hole >= 0) {
+                    /* the first hole seen while checking for duplicates */
+                    if (hole >> PAGE_SHIFT != n) {
+                        unlock_page(page);
+                        bitsfs_put_page(page, page_addr);
+                        page = bitsfs_get_page(dir, hole >> PAGE_SHIFT, 0, &page_addr);
+                        err = PTR_ERR(page);
+                        if (IS_ERR(page))
+                            goto out;
+                        lock_page(page);
+                    }
+                    de = (bitsfs_dirent *)((char *)page_addr + (hole & ~PAGE_MASK));
+                    goto got_hole;
+                }
+                if (bitsfs_vardent(dir->i_sb)) {
+                    /* a new page is a single empty entry */
+                    de->inode = 0;
+                    de->name_len = 0;
+                    de->rec_len = cpu_to_le16(bitsfs_chunk_size(dir));
+                }
                 goto got_it;
             }
             
             err = -EEXIST;
             if (bitsfs_name_match(child_len, child_name, de))
                 goto out_unlock; /* found same name dentry */
+
+            if (hole < 0 && bitsfs_room(dir, de) >= need)
+                hole = page_offset(page) + (char *)de - (char *)page_addr;
             
             /* step to next dentry */
-            de = (bitsfs_dirent *)((char*)de + DENT_LEN);
+            de = bitsfs_next_entry(de);
         }
         unlock_page(page);
         bitsfs_put_page(page, page_addr);
     }
-    return -EEXIST;
+    err = -EEXIST;
+    goto out;
+got_hole:
+    reuse = 1;
 got_it:
-    pos = page_offset(page) + (char*)de - (char*)page_addr;
-    err = bitsfs_prepare_chunk(page, pos, DENT_LEN);
-    if (err)    
-        goto out_unlock;
-    
-    /* construct dentry */
-    de->inode    = cpu_to_le32(inode->i_ino);
-    de->rec_len  = DENT_LEN;
-    de->name_len = dentry->d_name.len;
-    memcpy(de->name, child_name, child_len);
-    bitsfs_set_de_type(de, inode);
-
-    /* commit chunk */
-    err = bitsfs_commit_chunk(page, pos, DENT_LEN);
+    pos = bitsfs_insert_entry(dir, page, page_addr, de, child_name, child_len,
+            cpu_to_le32(inode->i_ino), fs_umode_to_ftype(inode->i_mode));
+    err = pos < 0 ? pos : 0;
+    if (reuse && !err)
+        bitsfs_fill_hole(dir, page->index, page_addr);
 
     /* change inode mtime & ctime */
     dir->i_mtime = dir->i_ctime = current_time(dir);
     mark_inode_dirty(dir);
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_add_link commit chunk, de=%p, name=%s, rec_len=%d", 
-            de, de->name, de->rec_len);
+    bitsfs_put_page(page, page_addr);
+    if (!err) {
+        bitsfs_dcache_add(dir, child_name, child_len, pos);
+        bitsfs_dx_add(dir, child_name, child_len, pos);
+        bitsfs_bloom_add(dir, child_name, child_len);
+        bitsfs_dir_count(dir, 1);
+    }
+    goto out;
 out_put:
     bitsfs_put_page(page, page_addr);
 out:
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_add_link end, ino=%d child_name=%s err=%d", 
-            inode->i_ino, child_name, err);
+    trace_bitsfs_add_link(dir, &dentry->d_name, inode->i_ino, pos, err);
     return err;
 out_unlock:
     unlock_page(page);
@@ -360,37 +748,203 @@ out_unlock:
 }
 
 /*
- * Delete a entry by set ino = 0
+ * Clear the entry `den' of the locked page, handing its space to the entry
+ * before it with vardent. Unlocks the page.
  */
-int bitsfs_delete_entry(struct inode *dir, bitsfs_dirent *den, struct page *page,
-            char *kaddr)
+static int __bitsfs_delete_entry(struct inode *dir, bitsfs_dirent *den,
+            struct page *page, char *kaddr)
 {
     int err;
     loff_t pos;
-    struct inode *inode = page->mapping->host;
-    unsigned from = ((char*)den - kaddr) & ~(bitsfs_chunk_size(inode)-1);
-    unsigned to = ((char *)den - kaddr) + DENT_LEN;
+    unsigned from = ((char*)den - kaddr) & ~(bitsfs_chunk_size(dir)-1);
+    unsigned to = ((char *)den - kaddr) + le16_to_cpu(den->rec_len);
+    bitsfs_dirent *pde = NULL;
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_delete_entry start, ino=%lu from=%p to=%p", inode->i_ino, from, to);
+    if (bitsfs_vardent(dir->i_sb)) {
+        bitsfs_dirent *de = (bitsfs_dirent *)(kaddr + from);
+
+        while ((char *)de < (char *)den) {
+            pde = de;
+            de = bitsfs_next_entry(de);
+        }
+        if (pde)
+            from = (char *)pde - kaddr;
+    }
 
     pos = page_offset(page) + from;
-    lock_page(page);
     err = bitsfs_prepare_chunk(page, pos, to - from);
     BUG_ON(err);
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_delete_entry prepare, ino=%lu err=%d", inode->i_ino, err);
+    if (pde)
+        pde->rec_len = cpu_to_le16(to - from);
     den->inode = 0;
-    err = bitsfs_commit_chunk(page, pos, to - from);
+    return bitsfs_commit_chunk(page, pos, to - from);
+}
+
+/*
+ * Delete a entry by set ino = 0
+ */
+int bitsfs_delete_entry(struct inode *dir, bitsfs_dirent *den, struct page *page,
+            char *kaddr)
+{
+    int err, last;
+    loff_t pos;
+    struct inode *inode = page->mapping->host;
+    bitsfs_dirent *first = (bitsfs_dirent *)kaddr;
+    ino_t ino = le32_to_cpu(den->inode);
+
+    pos = page_offset(page) + ((char *)den - kaddr);
+    bitsfs_dcache_delete(dir, den->name, den->name_len, pos);
+    bitsfs_dx_delete(dir, den->name, den->name_len, pos);
+    bitsfs_bloom_delete(dir);
+    bitsfs_dir_count(dir, -1);
+
+    /* the slot becomes a hole for the next bitsfs_add_link() */
+    BITSFS_I2BI(dir)->i_dir_holes++;
+    if (BITSFS_I2BI(dir)->i_dir_holemap)
+        __set_bit(page->index, BITSFS_I2BI(dir)->i_dir_holemap);
+
+    lock_page(page);
+    err = __bitsfs_delete_entry(dir, den, page, kaddr);
     inode->i_ctime = inode->i_mtime = current_time(inode);
     mark_inode_dirty(inode);
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_delete_entry end, ino=%lu err=%d", inode->i_ino, err);
-    
+    /* was it the last entry in use? then the holes before it can go as well */
+    if (bitsfs_vardent(dir->i_sb))
+        last = page->index && page->index + 1 == dir_pages(dir) &&
+            !first->inode && le16_to_cpu(first->rec_len) == bitsfs_chunk_size(dir);
+    else
+        last = pos + DENT_LEN >= dir->i_size ||
+            (((char *)den - kaddr) + DENT_LEN < PAGE_SIZE &&
+             ((bitsfs_dirent *)((char *)den + DENT_LEN))->rec_len == 0);
+
+    /* best effort, the entry itself is gone already */
+    if (!err && last)
+        bitsfs_compact_dir(dir);
+
+    trace_bitsfs_delete_entry(dir, ino, pos, err);
+    return err;
+}
+
+/*
+ * Directory compaction
+ *
+ * Readdir cookies are byte offsets of dirents and may outlive every open
+ * file, e.g. those nfsd hands out. Entries are therefore never moved: only
+ * the holes after the last live entry are cut off, which bitsfs_delete_entry()
+ * does whenever the tail entry goes. The caller holds the directory i_rwsem.
+ */
+
+/*
+ * Return the offset just past the last live entry, scanning back from the
+ * end, and count the holes behind it in `holes'. With vardent the entries
+ * chain to the end of the page, so that is the end of its page.
+ */
+static loff_t bitsfs_dir_live_end(struct inode *dir, __u32 *holes)
+{
+    unsigned long n = dir_pages(dir);
+    loff_t end;
+
+    *holes = 0;
+    while (n-- > 0) {
+        void *page_addr;
+        char *limit;
+        bitsfs_dirent *de, *last = NULL;
+        __u32 tail = 0;
+        struct page *page = bitsfs_get_page(dir, n, 0, &page_addr);
+
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+
+        de = (bitsfs_dirent *)page_addr;
+        limit = (char *)page_addr + bitsfs_last_byte(dir, n);
+        for (; (char *)de < limit && de->rec_len; de = bitsfs_next_entry(de)) {
+            if (de->inode) {
+                last = de;
+                tail = 0;
+            } else {
+                tail++;
+            }
+        }
+        if (!last || !bitsfs_vardent(dir->i_sb))
+            *holes += tail;
+        if (last)
+            end = page_offset(page) + (bitsfs_vardent(dir->i_sb) ? PAGE_SIZE :
+                    (char *)last + DENT_LEN - (char *)page_addr);
+        bitsfs_put_page(page, page_addr);
+        if (last)
+            return end;
+    }
+    return 0;
+}
+
+/*
+ * Turn everything from `end' on into free space and give back the pages
+ * and blocks past it
+ */
+static int bitsfs_dir_cut(struct inode *dir, loff_t end, __u32 holes)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    loff_t size = max_t(loff_t, end, bitsfs_chunk_size(dir));
+    unsigned long npages;
+    int err = 0;
+
+    if (!holes)
+        return 0;
+
+    /* cleared slots read as the end of the directory */
+    if (end & ~PAGE_MASK) {
+        void *page_addr;
+        unsigned len = min_t(loff_t, dir->i_size, round_up(end, PAGE_SIZE)) - end;
+        struct page *page = bitsfs_get_page(dir, end >> PAGE_SHIFT, 0, &page_addr);
+
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+
+        lock_page(page);
+        err = bitsfs_prepare_chunk(page, end, len);
+        if (err) {
+            unlock_page(page);
+            bitsfs_put_page(page, page_addr);
+            return err;
+        }
+        memset((char *)page_addr + (end & ~PAGE_MASK), 0, len);
+        err = bitsfs_commit_chunk(page, end, len);
+        bitsfs_put_page(page, page_addr);
+        if (err)
+            return err;
+    }
+
+    if (size < dir->i_size) {
+        i_size_write(dir, size);
+        truncate_pagecache(dir, size);
+        bitsfs_truncate_blocks(dir, size);
+        npages = dir_pages(dir);
+        if (bi->i_dir_holemap)
+            bitmap_clear(bi->i_dir_holemap, npages, BITSFS_MAX_DIR_PAGES - npages);
+    }
+    bi->i_dir_holes -= min(bi->i_dir_holes, holes);
+    mark_inode_dirty(dir);
+
+    if (IS_DIRSYNC(dir))
+        err = bitsfs_dirsync(dir);
     return err;
 }
 
+/*
+ * Compact a directory: cut off the free space at the end
+ */
+int bitsfs_compact_dir(struct inode *dir)
+{
+    loff_t end;
+    __u32 holes;
+
+    end = bitsfs_dir_live_end(dir, &holes);
+    if (end < 0)
+        return end;
+
+    return bitsfs_dir_cut(dir, end, holes);
+}
+
 /*
  * Set the first fragment of directory: . and ..
  */
@@ -405,6 +959,7 @@ int bitsfs_make_empty(struct inode *inode, struct inode *parent)
     if (!page)
         return -ENOMEM;
 
+    bitsfs_inline_dir_init(inode);
     err = bitsfs_prepare_chunk(page, 0, chunk_size);
     if (err) {
         unlock_page(page);
@@ -416,18 +971,30 @@ int bitsfs_make_empty(struct inode *inode, struct inode *parent)
     de = (bitsfs_dirent *)kaddr;
     de->inode = cpu_to_le32(inode->i_ino);
     de->name_len = 1;
-    de->rec_len = DENT_LEN;
+    de->rec_len = cpu_to_le16(bitsfs_dent_used(inode->i_sb, 1));
     memcpy (de->name, ".\0\0", 4);
     bitsfs_set_de_type (de, inode);
+    if (bitsfs_dirhash(inode->i_sb))
+        *bitsfs_dent_hash(inode->i_sb, de) = cpu_to_le32(bitsfs_name_hash(".", 1));
 
-    de = (bitsfs_dirent *)(kaddr + DENT_LEN);
+    de = bitsfs_next_entry(de);
     de->inode = cpu_to_le32(parent->i_ino);
     de->name_len = 2;
-    de->rec_len = DENT_LEN;
+    if (bitsfs_vardent(inode->i_sb))
+        de->rec_len = cpu_to_le16(chunk_size - bitsfs_dent_used(inode->i_sb, 1));
+    else
+        de->rec_len = cpu_to_le16(DENT_LEN);
     memcpy (de->name, "..\0", 4);
-    bitsfs_set_de_type (de, inode);
+    bitsfs_set_de_type (de, parent);
+    if (bitsfs_dirhash(inode->i_sb))
+        *bitsfs_dent_hash(inode->i_sb, de) = cpu_to_le32(bitsfs_name_hash("..", 2));
     kunmap_atomic(kaddr);
     err = bitsfs_commit_chunk(page, 0, chunk_size);
+
+    /* a new directory is counted from the start */
+    BITSFS_I2BI(inode)->i_dir_entries = 0;
+    BITSFS_I2BI(inode)->i_flags |= BITSFS_DIRCOUNT_FL;
+    mark_inode_dirty(inode);
 fail:
     put_page(page);
     return err;
@@ -435,17 +1002,32 @@ fail:
 
 /*
  * routine to check that the specified directory is empty (for rmdir)
+ *
+ * A counted directory that is not empty answers from i_dir_entries. The
+ * count and the entries go to disk apart, so after a crash a count of 0 may
+ * sit next to live entries: before rmdir frees it on a count of 0 the
+ * directory is scanned, usually the one page of "." and "..". Directories
+ * made before the count existed are scanned the same way and counted from
+ * then on.
  */
 int bitsfs_empty_dir(struct inode * inode)
 {
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(inode);
     int dir_has_error = 0;
     unsigned long i, npages = dir_pages(inode);
     void *page_addr = NULL;
     struct page *page = NULL;
     bitsfs_dirent * de;
+    struct file_ra_state ra;
+    __u32 entries = 0;
 
+    if ((bi->i_flags & BITSFS_DIRCOUNT_FL) && bi->i_dir_entries)
+        return 0;
+
+    file_ra_state_init(&ra, inode->i_mapping);
     for (i = 0; i < npages; i++) {
         char *kaddr;
+        bitsfs_dir_readahead(inode, &ra, NULL, i, npages);
         page = bitsfs_get_page(inode, i, dir_has_error, &page_addr);
         if (IS_ERR(page)) {
             dir_has_error = 1;
@@ -453,36 +1035,46 @@ int bitsfs_empty_dir(struct inode * inode)
         }
 
         de = (bitsfs_dirent *)page_addr;
-        kaddr = (char*)page_addr + bitsfs_last_byte(inode, i) - DENT_LEN;
+        kaddr = (char*)page_addr + bitsfs_last_byte(inode, i);
 
-        while ((char *)de <= kaddr) {
+        while ((char *)de < kaddr) {
+            /* end of the entries */
             if (de->rec_len == 0) {
-                bitsfs_msg(inode->i_sb, KERN_ERR, __func__, __FILE__, __LINE__,
-                        "Empty directory entry");
+                bitsfs_put_page(page, page_addr);
                 goto out;
             }
 
             if (de->inode != 0) {
                 /* check for . and .. */
                 if (de->name[0] != '.')
-                    goto not_empty;
-                if (de->name_len > 2)
-                    goto not_empty;
-                if (de->name_len < 2) {
+                    entries++;
+                else if (de->name_len > 2)
+                    entries++;
+                else if (de->name_len < 2) {
                     if (de->inode != cpu_to_le32(inode->i_ino))
-                        goto not_empty;
+                        entries++;
                 } else if (de->name[1] != '.')
-                    goto not_empty;
+                    entries++;
             }
-            de = (bitsfs_dirent *)((char*)de + DENT_LEN);
+            de = bitsfs_next_entry(de);
         }
         bitsfs_put_page(page, page_addr);
     }
 out:
-    return 1;
-not_empty:
-    bitsfs_put_page(page, page_addr);
-    return 0;
+    if (!dir_has_error) {
+        if ((bi->i_flags & BITSFS_DIRCOUNT_FL) && entries)
+            bitsfs_msg(inode->i_sb, KERN_WARNING, __func__, __FILE__, __LINE__,
+                    "Directory entry count 0 but %u entries, ino=%lu", entries, inode->i_ino);
+        bi->i_dir_entries = entries;
+        bi->i_flags |= BITSFS_DIRCOUNT_FL;
+        mark_inode_dirty(inode);
+    } else if (bi->i_flags & BITSFS_DIRCOUNT_FL) {
+        /* unreadable pages may hold entries, neither count nor free it */
+        bi->i_flags &= ~BITSFS_DIRCOUNT_FL;
+        mark_inode_dirty(inode);
+        return 0;
+    }
+    return !entries;
 }
 
 static int bitsfs_readdir(struct file *file, struct dir_context *ctx)
@@ -493,14 +1085,16 @@ static int bitsfs_readdir(struct file *file, struct dir_context *ctx)
     unsigned int offset = pos & ~PAGE_MASK;
     unsigned long n = pos >> PAGE_SHIFT;
     unsigned long npages = dir_pages(inode);
-
-    bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
-                   "bitsfs_readdir start ino=%lu", inode->i_ino);
+    unsigned chunk_mask = ~(bitsfs_chunk_size(inode) - 1);
+    bool need_revalidate = !inode_eq_iversion(inode, file->f_version);
 
     for ( ; n < npages; n++, offset = 0) {
         char *kaddr, *limit;
         bitsfs_dirent *de;
-        struct page *page = bitsfs_get_page(inode, n, 0, (void **)&kaddr);
+        struct page *page;
+
+        bitsfs_dir_readahead(inode, &file->f_ra, file, n, npages);
+        page = bitsfs_get_page(inode, n, 0, (void **)&kaddr);
 
         if (IS_ERR(page)) {
             bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
@@ -509,27 +1103,32 @@ static int bitsfs_readdir(struct file *file, struct dir_context *ctx)
             return PTR_ERR(page);
         }
 
+        /* the directory changed since the last call, the cookie may be mid-entry */
+        if (unlikely(need_revalidate)) {
+            if (offset) {
+                offset = bitsfs_validate_entry(kaddr, offset, chunk_mask);
+                ctx->pos = (n << PAGE_SHIFT) + offset;
+            }
+            file->f_version = inode_query_iversion(inode);
+            need_revalidate = false;
+        }
+
         de = (bitsfs_dirent *)(kaddr+offset);
-        limit = kaddr + bitsfs_last_byte(inode, n) - DENT_LEN;
-        for ( ;(char*)de <= limit;) {
+        limit = kaddr + bitsfs_last_byte(inode, n);
+        for ( ;(char*)de < limit;) {
             if (de->rec_len == 0) {
-                bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
-                        "bitsfs_readdir reach empty dentry");
                 bitsfs_put_page(page, kaddr);
                 goto out;
             }
             if (de->inode) {
-                bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
-                        "bitsfs_readdir loop, inode=%lu name=%s rec_len=%d", 
-                        de->inode, de->name, de->rec_len);
-                
-                if (!dir_emit(ctx, de->name, de->name_len, le32_to_cpu(de->inode), de->file_type)) {
+                if (!dir_emit(ctx, de->name, de->name_len, le32_to_cpu(de->inode),
+                        fs_ftype_to_dtype(de->file_type))) {
                     bitsfs_put_page(page, kaddr);
                     goto out;
                 }
             }
             ctx->pos += le16_to_cpu(de->rec_len);
-            de = (bitsfs_dirent *)((char*)de + DENT_LEN);
+            de = bitsfs_next_entry(de);
         }
         bitsfs_put_page(page, kaddr);
     }
@@ -541,5 +1140,9 @@ const struct file_operations bitsfs_dir_operations = {
     .llseek      = generic_file_llseek,
     .read        = generic_read_dir,
     .fsync       = generic_file_fsync,
+    .unlocked_ioctl = bitsfs_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl = bitsfs_compat_ioctl,
+#endif
     .iterate_shared = bitsfs_readdir,
 };
@@ -0,0 +1,249 @@
+#include "bitsfs.h"
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
+#include <linux/pagemap.h>
+
+/*
+ * Per-directory Bloom filter of names
+ *
+ * The first lookup that scans a whole directory without finding its name
+ * sets a bit array from all names of the directory; add_link sets the bits
+ * of every new name. A later lookup whose bits are not all set is a certain
+ * miss and returns -ENOENT without reading a directory page, which is what
+ * $PATH searches and module resolvers hit most.
+ *
+ * Bits cannot be cleared, so deleted names only make the filter less useful.
+ * It is dropped when the directory outgrows it or half of its names went
+ * away, and rebuilt by the next missing scan. Mount option dir_bloom= sets
+ * the bits per name, 0 turns the filter off.
+ *
+ * Changes happen under the directory lock held exclusively, lookups hold it
+ * shared and test bits under rcu_read_lock(). Only one of them builds.
+ */
+
+struct bitsfs_bloom {
+    struct rcu_head b_rcu;
+    unsigned int b_bits;           /* Power of two */
+    unsigned int b_hashes;         /* Bits set per name */
+    unsigned int b_capacity;       /* Names before the false positive rate degrades */
+    unsigned int b_count;          /* Names added */
+    unsigned int b_stale;          /* Names deleted since the build */
+    unsigned long b_map[];
+};
+
+static inline u32 bloom_step(u32 hash)
+{
+    /* second hash for double hashing, odd so that it spans the table */
+    return hash_32(hash, 32) | 1;
+}
+
+static void bloom_set(struct bitsfs_bloom *bf, u32 hash)
+{
+    u32 step = bloom_step(hash);
+    unsigned int i;
+
+    for (i = 0; i < bf->b_hashes; i++, hash += step)
+        set_bit(hash & (bf->b_bits - 1), bf->b_map);
+    bf->b_count++;
+}
+
+static int bloom_test(struct bitsfs_bloom *bf, u32 hash)
+{
+    u32 step = bloom_step(hash);
+    unsigned int i;
+
+    for (i = 0; i < bf->b_hashes; i++, hash += step) {
+        if (!test_bit(hash & (bf->b_bits - 1), bf->b_map))
+            return 0;
+    }
+    return 1;
+}
+
+static void bloom_free_rcu(struct rcu_head *head)
+{
+    kvfree(container_of(head, struct bitsfs_bloom, b_rcu));
+}
+
+/*
+ * Size a filter for a directory of `npages' pages
+ */
+static struct bitsfs_bloom *bloom_alloc(struct super_block *sb, unsigned long npages)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+    unsigned long names = max_t(unsigned long, npages, 1) * bitsfs_page_dents(sb);
+    unsigned long bits = roundup_pow_of_two(names * sbi->s_bloom_bits);
+    struct bitsfs_bloom *bf;
+
+    bf = kvzalloc(sizeof(*bf) + BITS_TO_LONGS(bits) * sizeof(long), GFP_KERNEL);
+    if (!bf)
+        return NULL;
+    bf->b_bits = bits;
+    bf->b_capacity = bits / sbi->s_bloom_bits;
+    /* k = bits per name * ln 2 minimizes false positives */
+    bf->b_hashes = clamp_t(unsigned int, sbi->s_bloom_bits * 7 / 10, 1, 16);
+    return bf;
+}
+
+/*
+ * Scan the directory, whose pages the failed lookup just read, into a filter
+ */
+static void bloom_build(struct inode *dir)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    unsigned long n, npages = dir_pages(dir);
+    struct bitsfs_bloom *bf;
+    struct file_ra_state ra;
+
+    if (test_and_set_bit(BITSFS_DIR_BLOOM_BUILD, &bi->i_dir_state))
+        return;
+    /* built since this lookup asked */
+    if (rcu_access_pointer(bi->i_bloom))
+        goto out;
+
+    bf = bloom_alloc(dir->i_sb, npages);
+    if (!bf)
+        goto out;
+
+    file_ra_state_init(&ra, dir->i_mapping);
+    for (n = 0; n < npages; n++) {
+        struct bitsfs_dir_entry *de;
+        void *page_addr;
+        char *limit;
+        struct page *page;
+
+        bitsfs_dir_readahead(dir, &ra, NULL, n, npages);
+        page = bitsfs_get_page(dir, n, 0, &page_addr);
+        if (IS_ERR(page))
+            goto fail;
+
+        de = (struct bitsfs_dir_entry *)page_addr;
+        limit = (char *)page_addr + min_t(loff_t, PAGE_SIZE,
+                dir->i_size - ((loff_t)n << PAGE_SHIFT));
+        for (; (char *)de < limit && de->rec_len; de = bitsfs_next_entry(de)) {
+            if (de->inode)
+                bloom_set(bf, bitsfs_dent_name_hash(dir->i_sb, de));
+        }
+        bitsfs_put_page(page, page_addr);
+    }
+
+    rcu_assign_pointer(bi->i_bloom, bf);
+    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Built dir bloom filter, ino=%lu bits=%u names=%u",
+            dir->i_ino, bf->b_bits, bf->b_count);
+    goto out;
+fail:
+    kvfree(bf);
+out:
+    clear_bit(BITSFS_DIR_BLOOM_BUILD, &bi->i_dir_state);
+}
+
+/*
+ * Ask the filter about `child'
+ *
+ * Returns 0 when the name is certainly not in the directory, 1 when it may
+ * be and -1 when the directory has no filter.
+ */
+int bitsfs_bloom_test(struct inode *dir, const struct qstr *child)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(dir->i_sb);
+    struct bitsfs_bloom *bf;
+    int ret = -1;
+
+    if (!rcu_access_pointer(BITSFS_I2BI(dir)->i_bloom))
+        return -1;
+
+    rcu_read_lock();
+    bf = rcu_dereference(BITSFS_I2BI(dir)->i_bloom);
+    if (bf)
+        ret = bloom_test(bf, bitsfs_name_hash(child->name, child->len));
+    rcu_read_unlock();
+
+    if (ret >= 0) {
+        percpu_counter_inc(&sbi->s_bloom_probes);
+        if (!ret)
+            percpu_counter_inc(&sbi->s_bloom_negative);
+    }
+    return ret;
+}
+
+/*
+ * A lookup scanned the whole directory and missed, `tested' is what
+ * bitsfs_bloom_test() said before
+ */
+void bitsfs_bloom_miss(struct inode *dir, int tested)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(dir->i_sb);
+
+    if (tested > 0)
+        percpu_counter_inc(&sbi->s_bloom_false_pos);
+    else if (tested < 0 && sbi->s_bloom_bits && dir_pages(dir))
+        bloom_build(dir);
+}
+
+/*
+ * Record a new name, caller holds the dir lock exclusively
+ */
+void bitsfs_bloom_add(struct inode *dir, const char *name, int len)
+{
+    struct bitsfs_bloom *bf;
+
+    bf = rcu_dereference_protected(BITSFS_I2BI(dir)->i_bloom, inode_is_locked(dir));
+    if (!bf)
+        return;
+    if (bf->b_count >= bf->b_capacity) {
+        bitsfs_bloom_drop(dir);
+        return;
+    }
+    bloom_set(bf, bitsfs_name_hash(name, len));
+}
+
+/*
+ * A name went away, caller holds the dir lock exclusively
+ */
+void bitsfs_bloom_delete(struct inode *dir)
+{
+    struct bitsfs_bloom *bf;
+
+    bf = rcu_dereference_protected(BITSFS_I2BI(dir)->i_bloom, inode_is_locked(dir));
+    if (bf && ++bf->b_stale * 2 > bf->b_count)
+        bitsfs_bloom_drop(dir);
+}
+
+/*
+ * Free the filter of a directory
+ */
+void bitsfs_bloom_drop(struct inode *dir)
+{
+    struct bitsfs_bloom *bf;
+
+    bf = xchg((struct bitsfs_bloom **)&BITSFS_I2BI(dir)->i_bloom, NULL);
+    if (bf)
+        call_rcu(&bf->b_rcu, bloom_free_rcu);
+}
+
+/*
+ * Report the filter of `dir' and the mount wide counters
+ */
+void bitsfs_bloom_stats(struct inode *dir, struct bitsfs_bloom_stats *st)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(dir->i_sb);
+    struct bitsfs_bloom *bf;
+
+    memset(st, 0, sizeof(*st));
+    st->bs_bits_per_name = sbi->s_bloom_bits;
+
+    rcu_read_lock();
+    bf = rcu_dereference(BITSFS_I2BI(dir)->i_bloom);
+    if (bf) {
+        st->bs_bits = bf->b_bits;
+        st->bs_hashes = bf->b_hashes;
+        st->bs_names = bf->b_count;
+        st->bs_stale = bf->b_stale;
+    }
+    rcu_read_unlock();
+
+    st->bs_probes = percpu_counter_sum_positive(&sbi->s_bloom_probes);
+    st->bs_negative = percpu_counter_sum_positive(&sbi->s_bloom_negative);
+    st->bs_false_pos = percpu_counter_sum_positive(&sbi->s_bloom_false_pos);
+}
@@ -0,0 +1,369 @@
+#include "bitsfs.h"
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/pagemap.h>
+
+/*
+ * In-memory directory name cache
+ *
+ * A directory of BITSFS_DCACHE_MIN_PAGES or more pages gets an open
+ * addressing table of (name hash, dirent offset) the first time it has to
+ * be scanned. From then on lookups, negative lookups and the duplicate check
+ * of add_link cost one table probe plus at most one cached leaf page, with
+ * no on-disk format change.
+ *
+ * The table is changed in place by add_link and delete_entry, which hold the
+ * directory lock exclusively, and read by lookups holding it shared. Parallel
+ * lookups of a directory without a table let one of them build it. The
+ * shrinker and eviction can detach a table at any time, so every access
+ * runs under rcu_read_lock() and tables are freed after a grace period.
+ */
+
+#define BITSFS_DCACHE_MAX_PROBE  8     /* Hash hits verified per lookup */
+
+struct bitsfs_dcache_slot {
+    u32    hash;        /* Name hash */
+    u32    pos;         /* Dirent offset, 0 when empty */
+};
+
+struct bitsfs_dcache {
+    struct list_head d_lru;             /* On sbi->s_dcache_lru */
+    struct bitsfs_inode_info *d_bi;     /* Owning directory */
+    struct rcu_head d_rcu;
+    unsigned int d_slots;               /* Power of two */
+    unsigned int d_count;               /* Live slots */
+    unsigned int d_deleted;             /* Deleted slots */
+    int d_referenced;                   /* Used since the last shrinker pass */
+    struct bitsfs_dcache_slot d_slot[];
+};
+
+static inline int dc_is_dot(const char *name, int len)
+{
+    return name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'));
+}
+
+static struct bitsfs_dcache *dc_alloc(unsigned int slots)
+{
+    struct bitsfs_dcache *dc;
+
+    dc = kvzalloc(sizeof(*dc) + slots * sizeof(struct bitsfs_dcache_slot), GFP_KERNEL);
+    if (dc)
+        dc->d_slots = slots;
+    return dc;
+}
+
+static void dc_free_rcu(struct rcu_head *head)
+{
+    kvfree(container_of(head, struct bitsfs_dcache, d_rcu));
+}
+
+static void dc_insert(struct bitsfs_dcache *dc, u32 hash, u32 pos)
+{
+    unsigned int mask = dc->d_slots - 1;
+    unsigned int slot = hash & mask;
+
+    while (dc->d_slot[slot].pos && dc->d_slot[slot].pos != BITSFS_DX_DELETED)
+        slot = (slot + 1) & mask;
+
+    if (dc->d_slot[slot].pos)
+        dc->d_deleted--;
+    dc->d_slot[slot].hash = hash;
+    WRITE_ONCE(dc->d_slot[slot].pos, pos);
+    dc->d_count++;
+}
+
+static void dc_remove(struct bitsfs_dcache *dc, u32 hash, u32 pos)
+{
+    unsigned int mask = dc->d_slots - 1;
+    unsigned int slot = hash & mask;
+
+    for (; dc->d_slot[slot].pos; slot = (slot + 1) & mask) {
+        if (dc->d_slot[slot].pos != pos || dc->d_slot[slot].hash != hash)
+            continue;
+        WRITE_ONCE(dc->d_slot[slot].pos, BITSFS_DX_DELETED);
+        dc->d_count--;
+        dc->d_deleted++;
+        return;
+    }
+}
+
+/*
+ * Install `dc' on the directory unless another table got there first
+ */
+static int dc_install(struct bitsfs_sb_info *sbi, struct bitsfs_inode_info *bi,
+        struct bitsfs_dcache *dc)
+{
+    spin_lock(&sbi->s_dcache_lock);
+    if (rcu_access_pointer(bi->i_dcache)) {
+        spin_unlock(&sbi->s_dcache_lock);
+        return -EEXIST;
+    }
+    dc->d_bi = bi;
+    list_add_tail(&dc->d_lru, &sbi->s_dcache_lru);
+    rcu_assign_pointer(bi->i_dcache, dc);
+    spin_unlock(&sbi->s_dcache_lock);
+    return 0;
+}
+
+/*
+ * Detach the table of `bi', caller holds s_dcache_lock
+ */
+static void dc_detach(struct bitsfs_sb_info *sbi, struct bitsfs_dcache *dc)
+{
+    RCU_INIT_POINTER(dc->d_bi->i_dcache, NULL);
+    list_del(&dc->d_lru);
+    atomic_long_sub(dc->d_slots, &sbi->s_dcache_slots);
+    call_rcu(&dc->d_rcu, dc_free_rcu);
+}
+
+/*
+ * Scan the directory once and build its table
+ */
+static void dc_build(struct inode *dir)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(dir->i_sb);
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    unsigned long n, npages = dir_pages(dir);
+    struct bitsfs_dcache *dc;
+    unsigned int slots;
+    struct file_ra_state ra;
+
+    if (test_and_set_bit(BITSFS_DIR_DCACHE_BUILD, &bi->i_dir_state))
+        return;
+
+    /* room for a full directory at load factor 1/2 */
+    slots = roundup_pow_of_two(npages * bitsfs_page_dents(dir->i_sb) * 2);
+    if (atomic_long_add_return(slots, &sbi->s_dcache_slots) > sbi->s_dcache_max)
+        goto uncharge;
+
+    dc = dc_alloc(slots);
+    if (!dc)
+        goto uncharge;
+
+    file_ra_state_init(&ra, dir->i_mapping);
+    for (n = 0; n < npages; n++) {
+        struct bitsfs_dir_entry *de;
+        void *page_addr;
+        char *limit;
+        struct page *page;
+
+        bitsfs_dir_readahead(dir, &ra, NULL, n, npages);
+        page = bitsfs_get_page(dir, n, 0, &page_addr);
+
+        if (IS_ERR(page))
+            goto fail;
+
+        de = (struct bitsfs_dir_entry *)page_addr;
+        limit = (char *)page_addr + min_t(loff_t, PAGE_SIZE,
+                dir->i_size - ((loff_t)n << PAGE_SHIFT));
+        for (; (char *)de < limit && de->rec_len; de = bitsfs_next_entry(de)) {
+            if (!de->inode || dc_is_dot(de->name, de->name_len))
+                continue;
+            dc_insert(dc, bitsfs_dent_name_hash(dir->i_sb, de),
+                    (n << PAGE_SHIFT) + ((char *)de - (char *)page_addr));
+        }
+        bitsfs_put_page(page, page_addr);
+    }
+
+    if (!dc_install(sbi, bi, dc)) {
+        bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
+                "Built dir name cache, ino=%lu slots=%u entries=%u",
+                dir->i_ino, slots, dc->d_count);
+        goto out;
+    }
+fail:
+    kvfree(dc);
+uncharge:
+    atomic_long_sub(slots, &sbi->s_dcache_slots);
+out:
+    clear_bit(BITSFS_DIR_DCACHE_BUILD, &bi->i_dir_state);
+}
+
+/*
+ * Find a dirent through the name cache, building it on first use.
+ *
+ * Returns the entry with its page mapped, ERR_PTR(-ENOENT) when the name is
+ * not in the directory, or NULL when the directory has no usable cache.
+ */
+struct bitsfs_dir_entry *bitsfs_dcache_find(struct inode *dir,
+        const struct qstr *child, struct page **res_page, void **res_page_addr)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(dir->i_sb);
+    struct bitsfs_dir_entry *de;
+    struct bitsfs_dcache *dc;
+    u32 cand[BITSFS_DCACHE_MAX_PROBE];
+    unsigned int mask, slot, pos, nr = 0, i;
+    u32 hash;
+
+    if (!sbi->s_dcache_max)
+        return NULL;
+    if (!rcu_access_pointer(bi->i_dcache)) {
+        if (dir_pages(dir) < BITSFS_DCACHE_MIN_PAGES)
+            return NULL;
+        dc_build(dir);
+    }
+
+    hash = bitsfs_name_hash(child->name, child->len);
+
+    /* collect the offsets with a matching hash, verify them outside RCU */
+    rcu_read_lock();
+    dc = rcu_dereference(bi->i_dcache);
+    if (!dc) {
+        rcu_read_unlock();
+        return NULL;
+    }
+    if (!READ_ONCE(dc->d_referenced))
+        WRITE_ONCE(dc->d_referenced, 1);
+
+    mask = dc->d_slots - 1;
+    for (slot = hash & mask; (pos = READ_ONCE(dc->d_slot[slot].pos)); slot = (slot + 1) & mask) {
+        if (pos == BITSFS_DX_DELETED || dc->d_slot[slot].hash != hash)
+            continue;
+        if (nr == BITSFS_DCACHE_MAX_PROBE) {
+            rcu_read_unlock();
+            return NULL;
+        }
+        cand[nr++] = pos;
+    }
+    rcu_read_unlock();
+
+    for (i = 0; i < nr; i++) {
+        de = bitsfs_entry_at(dir, cand[i], child, res_page, res_page_addr);
+        if (de)
+            return de;
+    }
+    return ERR_PTR(-ENOENT);
+}
+
+/*
+ * Grow the table of `dir' to twice its size, caller holds the dir lock
+ */
+static void dc_grow(struct inode *dir, unsigned int slots)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(dir->i_sb);
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct bitsfs_dcache *old, *dc;
+    unsigned int n;
+
+    if (atomic_long_add_return(slots * 2, &sbi->s_dcache_slots) > sbi->s_dcache_max ||
+            !(dc = dc_alloc(slots * 2))) {
+        atomic_long_sub(slots * 2, &sbi->s_dcache_slots);
+        bitsfs_dcache_drop(dir);
+        return;
+    }
+
+    spin_lock(&sbi->s_dcache_lock);
+    old = rcu_dereference_protected(bi->i_dcache, lockdep_is_held(&sbi->s_dcache_lock));
+    if (!old) {
+        spin_unlock(&sbi->s_dcache_lock);
+        atomic_long_sub(slots * 2, &sbi->s_dcache_slots);
+        kvfree(dc);
+        return;
+    }
+    for (n = 0; n < old->d_slots; n++) {
+        if (old->d_slot[n].pos && old->d_slot[n].pos != BITSFS_DX_DELETED)
+            dc_insert(dc, old->d_slot[n].hash, old->d_slot[n].pos);
+    }
+    dc->d_bi = bi;
+    list_add_tail(&dc->d_lru, &sbi->s_dcache_lru);
+    rcu_assign_pointer(bi->i_dcache, dc);
+    list_del(&old->d_lru);
+    atomic_long_sub(old->d_slots, &sbi->s_dcache_slots);
+    call_rcu(&old->d_rcu, dc_free_rcu);
+    spin_unlock(&sbi->s_dcache_lock);
+}
+
+/*
+ * Record a new dirent at `pos', caller holds the dir lock exclusively
+ */
+void bitsfs_dcache_add(struct inode *dir, const char *name, int len, loff_t pos)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct bitsfs_dcache *dc;
+    unsigned int grow = 0;
+
+    rcu_read_lock();
+    dc = rcu_dereference(bi->i_dcache);
+    if (dc) {
+        if ((dc->d_count + dc->d_deleted + 1) * 2 > dc->d_slots)
+            grow = dc->d_slots;
+        else
+            dc_insert(dc, bitsfs_name_hash(name, len), pos);
+    }
+    rcu_read_unlock();
+
+    if (grow) {
+        dc_grow(dir, grow);
+        bitsfs_dcache_add(dir, name, len, pos);
+    }
+}
+
+/*
+ * Forget the dirent at `pos', caller holds the dir lock exclusively
+ */
+void bitsfs_dcache_delete(struct inode *dir, const char *name, int len, loff_t pos)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct bitsfs_dcache *dc;
+
+    rcu_read_lock();
+    dc = rcu_dereference(bi->i_dcache);
+    if (dc)
+        dc_remove(dc, bitsfs_name_hash(name, len), pos);
+    rcu_read_unlock();
+}
+
+/*
+ * Free the table of a directory, e.g. on eviction
+ */
+void bitsfs_dcache_drop(struct inode *dir)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(dir->i_sb);
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct bitsfs_dcache *dc;
+
+    if (!rcu_access_pointer(bi->i_dcache))
+        return;
+
+    spin_lock(&sbi->s_dcache_lock);
+    dc = rcu_dereference_protected(bi->i_dcache, lockdep_is_held(&sbi->s_dcache_lock));
+    if (dc)
+        dc_detach(sbi, dc);
+    spin_unlock(&sbi->s_dcache_lock);
+}
+
+unsigned long bitsfs_dcache_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+    struct bitsfs_sb_info *sbi = container_of(shrink, struct bitsfs_sb_info, s_dcache_shrinker);
+
+    return atomic_long_read(&sbi->s_dcache_slots);
+}
+
+/*
+ * Free whole tables in LRU order, giving recently used ones a second pass
+ */
+unsigned long bitsfs_dcache_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+    struct bitsfs_sb_info *sbi = container_of(shrink, struct bitsfs_sb_info, s_dcache_shrinker);
+    struct bitsfs_dcache *dc, *next;
+    unsigned long freed = 0;
+    LIST_HEAD(referenced);
+
+    spin_lock(&sbi->s_dcache_lock);
+    list_for_each_entry_safe(dc, next, &sbi->s_dcache_lru, d_lru) {
+        if (freed >= sc->nr_to_scan)
+            break;
+        if (READ_ONCE(dc->d_referenced)) {
+            WRITE_ONCE(dc->d_referenced, 0);
+            list_move_tail(&dc->d_lru, &referenced);
+            continue;
+        }
+        freed += dc->d_slots;
+        dc_detach(sbi, dc);
+    }
+    list_splice_tail(&referenced, &sbi->s_dcache_lru);
+    spin_unlock(&sbi->s_dcache_lock);
+
+    return freed;
+}
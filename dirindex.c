@@ -0,0 +1,504 @@
+#include "bitsfs.h"
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+
+/*
+ * Hashed directory index
+ *
+ * Once a directory reaches BITSFS_DX_THRESHOLD pages it gets an open
+ * addressing hash table in a contiguous run of blocks. Each slot maps the
+ * hash of a name to the byte offset of its dirent, so lookup, create and
+ * unlink read one index block and one leaf page instead of the whole
+ * directory. Leaf pages keep their layout and readdir never looks at the
+ * index.
+ *
+ * The leaf pages stay authoritative: when the index cannot be read or
+ * updated it is dropped and the directory goes back to linear scans.
+ *
+ * Index blocks and leaf pages are written back apart, so after a crash the
+ * index may miss names the pages have. The root keeps the directory size
+ * and the live count at its last update; the first use after the inode is
+ * read checks them against i_size and i_dir_entries and a stale index is
+ * dropped. Compaction only cuts off empty pages, so a smaller directory
+ * still matches.
+ */
+
+#define BITSFS_DX_PER_BLOCK  (BITSFS_BLOCK_SIZE / sizeof(struct bitsfs_dx_entry))
+#define BITSFS_DX_HDR_SLOTS  (sizeof(struct bitsfs_dx_root) / sizeof(struct bitsfs_dx_entry))
+
+struct dx_probe {
+    struct inode *dir;
+    unsigned long start;            /* First block of the extent */
+    unsigned long slots;            /* Slots in the extent */
+    unsigned long blk;              /* Extent block held in bh */
+    struct buffer_head *bh;         /* Current slot block */
+    struct buffer_head *root_bh;    /* Block holding the root header */
+};
+
+/*
+ * Name hash, stable on disk
+ */
+u32 bitsfs_name_hash(const char *name, int len)
+{
+    __u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    const unsigned char *ucp = (const unsigned char *)name;
+
+    while (len--) {
+        hash = hash1 + (hash0 ^ (*ucp++ * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+/*
+ * Hash of the name of `de', read back from the entry when it carries one
+ */
+u32 bitsfs_dent_name_hash(struct super_block *sb, struct bitsfs_dir_entry *de)
+{
+    if (bitsfs_dirhash(sb))
+        return le32_to_cpu(*bitsfs_dent_hash(sb, de));
+    return bitsfs_name_hash(de->name, de->name_len);
+}
+
+static inline unsigned long dx_slots(unsigned long blocks)
+{
+    return blocks * BITSFS_DX_PER_BLOCK - BITSFS_DX_HDR_SLOTS;
+}
+
+static inline struct bitsfs_dx_root *dx_root(struct dx_probe *p)
+{
+    return (struct bitsfs_dx_root *)p->root_bh->b_data;
+}
+
+static inline int dx_is_dot(const char *name, int len)
+{
+    return name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'));
+}
+
+/*
+ * Read the root of the index extent starting at `start'
+ */
+static int dx_open(struct inode *dir, unsigned long start, struct dx_probe *p)
+{
+    struct bitsfs_dx_root *root;
+    unsigned long blocks;
+
+    p->dir = dir;
+    p->start = start;
+    p->bh = NULL;
+    p->root_bh = sb_bread(dir->i_sb, start);
+    if (!p->root_bh) {
+        bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Cannot read dir index, ino=%lu block=%lu", dir->i_ino, start);
+        return -EIO;
+    }
+
+    root = dx_root(p);
+    blocks = le32_to_cpu(root->dx_blocks);
+    if ((le32_to_cpu(root->dx_magic) != BITSFS_DX_MAGIC &&
+            le32_to_cpu(root->dx_magic) != BITSFS_DX_MAGIC_V1) ||
+            !blocks || blocks > BITSFS_DX_MAX_BLOCKS) {
+        bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Corrupt dir index, ino=%lu block=%lu", dir->i_ino, start);
+        brelse(p->root_bh);
+        p->root_bh = NULL;
+        return -EUCLEAN;
+    }
+
+    p->slots = dx_slots(blocks);
+    get_bh(p->root_bh);
+    p->bh = p->root_bh;
+    p->blk = 0;
+    return 0;
+}
+
+static void dx_close(struct dx_probe *p)
+{
+    brelse(p->bh);
+    brelse(p->root_bh);
+}
+
+/*
+ * Check an index once per inode lifetime, -ESTALE when it does not match
+ * the directory
+ */
+static int dx_check(struct dx_probe *p)
+{
+    struct inode *dir = p->dir;
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct bitsfs_dx_root *root = dx_root(p);
+
+    if (test_bit(BITSFS_DIR_DX_CHECKED, &bi->i_dir_state))
+        return 0;
+    if (le32_to_cpu(root->dx_magic) == BITSFS_DX_MAGIC &&
+            dir->i_size <= le32_to_cpu(root->dx_size) &&
+            (!(bi->i_flags & BITSFS_DIRCOUNT_FL) ||
+             le32_to_cpu(root->dx_count) == bi->i_dir_entries)) {
+        set_bit(BITSFS_DIR_DX_CHECKED, &bi->i_dir_state);
+        return 0;
+    }
+    bitsfs_msg(dir->i_sb, KERN_WARNING, __func__, __FILE__, __LINE__,
+            "Stale dir index, ino=%lu size=%lld/%u count=%u/%u", dir->i_ino,
+            dir->i_size, le32_to_cpu(root->dx_size), bi->i_dir_entries,
+            le32_to_cpu(root->dx_count));
+    return -ESTALE;
+}
+
+static inline void dx_set_size(struct dx_probe *p)
+{
+    dx_root(p)->dx_size = cpu_to_le32(p->dir->i_size);
+}
+
+/*
+ * Return the slot, reading its block if needed
+ */
+static struct bitsfs_dx_entry *dx_slot(struct dx_probe *p, unsigned long slot)
+{
+    unsigned long blk;
+
+    slot += BITSFS_DX_HDR_SLOTS;
+    blk = slot / BITSFS_DX_PER_BLOCK;
+    if (p->blk != blk) {
+        brelse(p->bh);
+        p->bh = sb_bread(p->dir->i_sb, p->start + blk);
+        if (!p->bh) {
+            bitsfs_msg(p->dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                    "Cannot read dir index, ino=%lu block=%lu",
+                    p->dir->i_ino, p->start + blk);
+            return ERR_PTR(-EIO);
+        }
+        p->blk = blk;
+    }
+    return (struct bitsfs_dx_entry *)p->bh->b_data + slot % BITSFS_DX_PER_BLOCK;
+}
+
+static inline unsigned long dx_next(struct dx_probe *p, unsigned long slot)
+{
+    return ++slot == p->slots ? 0 : slot;
+}
+
+static int dx_insert(struct dx_probe *p, u32 hash, u32 pos)
+{
+    unsigned long i, slot = hash % p->slots;
+    struct bitsfs_dx_entry *e;
+
+    for (i = 0; i < p->slots; i++, slot = dx_next(p, slot)) {
+        e = dx_slot(p, slot);
+        if (IS_ERR(e))
+            return PTR_ERR(e);
+        if (e->pos && e->pos != cpu_to_le32(BITSFS_DX_DELETED))
+            continue;
+
+        if (e->pos)
+            le32_add_cpu(&dx_root(p)->dx_deleted, -1);
+        e->hash = cpu_to_le32(hash);
+        e->pos = cpu_to_le32(pos);
+        mark_buffer_dirty_inode(p->bh, p->dir);
+
+        le32_add_cpu(&dx_root(p)->dx_count, 1);
+        dx_set_size(p);
+        mark_buffer_dirty_inode(p->root_bh, p->dir);
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+static int dx_remove(struct dx_probe *p, u32 hash, u32 pos)
+{
+    unsigned long i, slot = hash % p->slots;
+    struct bitsfs_dx_entry *e;
+
+    for (i = 0; i < p->slots; i++, slot = dx_next(p, slot)) {
+        e = dx_slot(p, slot);
+        if (IS_ERR(e))
+            return PTR_ERR(e);
+        if (!e->pos)
+            break;
+        if (le32_to_cpu(e->pos) != pos || le32_to_cpu(e->hash) != hash)
+            continue;
+
+        e->pos = cpu_to_le32(BITSFS_DX_DELETED);
+        mark_buffer_dirty_inode(p->bh, p->dir);
+
+        le32_add_cpu(&dx_root(p)->dx_count, -1);
+        le32_add_cpu(&dx_root(p)->dx_deleted, 1);
+        dx_set_size(p);
+        mark_buffer_dirty_inode(p->root_bh, p->dir);
+        return 0;
+    }
+    return -ENOENT;
+}
+
+/*
+ * Find a dirent through the index.
+ *
+ * Returns the entry with its page mapped, ERR_PTR(-ENOENT) when the name is
+ * not in the directory, or NULL when the index cannot be used and the
+ * caller has to scan the leaf pages. A stale index is left for the next
+ * update to drop, lookups only hold the directory lock shared.
+ */
+struct bitsfs_dir_entry *bitsfs_dx_find_entry(struct inode *dir,
+        const struct qstr *child, struct page **res_page, void **res_page_addr)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct bitsfs_dir_entry *de = ERR_PTR(-ENOENT);
+    struct bitsfs_dx_entry *e;
+    struct dx_probe p;
+    unsigned long i, slot;
+    u32 hash;
+
+    if (!(bi->i_flags & BITSFS_INDEX_FL))
+        return NULL;
+    if (dx_open(dir, bi->i_dx_block, &p))
+        return NULL;
+    if (dx_check(&p)) {
+        dx_close(&p);
+        return NULL;
+    }
+
+    hash = bitsfs_name_hash(child->name, child->len);
+    slot = hash % p.slots;
+    for (i = 0; i < p.slots; i++, slot = dx_next(&p, slot)) {
+        e = dx_slot(&p, slot);
+        if (IS_ERR(e)) {
+            de = NULL;
+            break;
+        }
+        if (!e->pos)
+            break;
+        if (e->pos == cpu_to_le32(BITSFS_DX_DELETED) || le32_to_cpu(e->hash) != hash)
+            continue;
+
+        de = bitsfs_entry_at(dir, le32_to_cpu(e->pos), child, res_page, res_page_addr);
+        if (de)
+            break;
+        de = ERR_PTR(-ENOENT);
+    }
+    dx_close(&p);
+    return de;
+}
+
+/*
+ * Free an index extent, dropping any cached copy of its blocks first
+ */
+static void dx_free_extent(struct inode *dir, unsigned long start, unsigned long blocks)
+{
+    struct buffer_head *bh;
+    unsigned long n;
+
+    for (n = 0; n < blocks; n++) {
+        bh = sb_find_get_block(dir->i_sb, start + n);
+        if (bh)
+            bforget(bh);
+    }
+    bitsfs_free_blocks(dir, start, blocks);
+}
+
+/*
+ * Write a new index extent for the directory from its leaf pages
+ */
+static int dx_build(struct inode *dir)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct super_block *sb = dir->i_sb;
+    unsigned long npages = dir_pages(dir);
+    unsigned long entries = npages * bitsfs_page_dents(dir->i_sb);
+    unsigned long n, blocks, start;
+    struct bitsfs_dx_root *root;
+    struct buffer_head *bh;
+    struct dx_probe p;
+    struct file_ra_state ra;
+    int err;
+
+    /* keep the load factor at or below 1/4 after a build */
+    blocks = roundup_pow_of_two(DIV_ROUND_UP(entries * 4 + BITSFS_DX_HDR_SLOTS,
+                BITSFS_DX_PER_BLOCK));
+    if (blocks > BITSFS_DX_MAX_BLOCKS)
+        blocks = BITSFS_DX_MAX_BLOCKS;
+
+    err = bitsfs_new_blocks(dir, blocks, &start);
+    if (err)
+        return err;
+
+    for (n = 0; n < blocks; n++) {
+        bh = sb_getblk(sb, start + n);
+        if (!bh) {
+            err = -ENOMEM;
+            goto fail;
+        }
+        lock_buffer(bh);
+        memset(bh->b_data, 0, BITSFS_BLOCK_SIZE);
+        if (n == 0) {
+            root = (struct bitsfs_dx_root *)bh->b_data;
+            root->dx_magic = cpu_to_le32(BITSFS_DX_MAGIC);
+            root->dx_blocks = cpu_to_le32(blocks);
+            root->dx_size = cpu_to_le32(dir->i_size);
+        }
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty_inode(bh, dir);
+        brelse(bh);
+    }
+
+    err = dx_open(dir, start, &p);
+    if (err)
+        goto fail;
+
+    file_ra_state_init(&ra, dir->i_mapping);
+    for (n = 0; n < npages && !err; n++) {
+        struct bitsfs_dir_entry *de;
+        void *page_addr;
+        char *limit;
+        struct page *page;
+
+        bitsfs_dir_readahead(dir, &ra, NULL, n, npages);
+        page = bitsfs_get_page(dir, n, 0, &page_addr);
+
+        if (IS_ERR(page)) {
+            err = PTR_ERR(page);
+            break;
+        }
+
+        de = (struct bitsfs_dir_entry *)page_addr;
+        limit = (char *)page_addr + min_t(loff_t, PAGE_SIZE,
+                dir->i_size - ((loff_t)n << PAGE_SHIFT));
+        for (; (char *)de < limit && de->rec_len; de = bitsfs_next_entry(de)) {
+            if (!de->inode || dx_is_dot(de->name, de->name_len))
+                continue;
+            err = dx_insert(&p, bitsfs_dent_name_hash(sb, de),
+                    (n << PAGE_SHIFT) + ((char *)de - (char *)page_addr));
+            if (err)
+                break;
+        }
+        bitsfs_put_page(page, page_addr);
+    }
+    dx_close(&p);
+    if (err)
+        goto fail;
+
+    /* switch to the new extent */
+    bitsfs_dx_drop(dir);
+    bi->i_dx_block = start;
+    bi->i_flags |= BITSFS_INDEX_FL;
+    set_bit(BITSFS_DIR_DX_CHECKED, &bi->i_dir_state);
+    mark_inode_dirty(dir);
+
+    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Built dir index, ino=%lu block=%lu blocks=%lu", dir->i_ino, start, blocks);
+    return 0;
+fail:
+    bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+            "Failed to build dir index, ino=%lu err=%d", dir->i_ino, err);
+    dx_free_extent(dir, start, blocks);
+    /* a full scan per insert would follow, linear lookups until evicted */
+    set_bit(BITSFS_DIR_DX_FAILED, &bi->i_dir_state);
+    return err;
+}
+
+/*
+ * Record a new dirent at `pos', building or growing the index as needed
+ */
+void bitsfs_dx_add(struct inode *dir, const char *name, int len, loff_t pos)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct bitsfs_dx_root *root;
+    struct dx_probe p;
+    int err;
+
+    if (!(bi->i_flags & BITSFS_INDEX_FL)) {
+        if (dir_pages(dir) >= BITSFS_DX_THRESHOLD &&
+                !test_bit(BITSFS_DIR_DX_FAILED, &bi->i_dir_state))
+            dx_build(dir);
+        return;
+    }
+
+    err = dx_open(dir, bi->i_dx_block, &p);
+    if (err)
+        goto drop;
+    err = dx_check(&p);
+    if (err) {
+        dx_close(&p);
+        goto drop;
+    }
+
+    /*
+     * rebuild once live and deleted slots pass half the table. A table
+     * that cannot grow is rebuilt only while that leaves it under a
+     * quarter full, past that the directory goes back to scans for good
+     */
+    root = dx_root(&p);
+    if ((le32_to_cpu(root->dx_count) + le32_to_cpu(root->dx_deleted) + 1) * 2 > p.slots) {
+        if (le32_to_cpu(root->dx_blocks) >= BITSFS_DX_MAX_BLOCKS &&
+                (le32_to_cpu(root->dx_count) + 1) * 4 > p.slots) {
+            dx_close(&p);
+            bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
+                    "Dir outgrew its index, ino=%lu", dir->i_ino);
+            set_bit(BITSFS_DIR_DX_FAILED, &bi->i_dir_state);
+            goto drop;
+        }
+        dx_close(&p);
+        if (dx_build(dir))
+            goto drop;
+        return;
+    }
+
+    err = dx_insert(&p, bitsfs_name_hash(name, len), pos);
+    dx_close(&p);
+    if (!err)
+        return;
+drop:
+    bitsfs_dx_drop(dir);
+}
+
+/*
+ * Forget the dirent at `pos'
+ */
+void bitsfs_dx_delete(struct inode *dir, const char *name, int len, loff_t pos)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct dx_probe p;
+    int err;
+
+    if (!(bi->i_flags & BITSFS_INDEX_FL))
+        return;
+
+    err = dx_open(dir, bi->i_dx_block, &p);
+    if (!err) {
+        err = dx_check(&p);
+        if (!err)
+            err = dx_remove(&p, bitsfs_name_hash(name, len), pos);
+        dx_close(&p);
+    }
+    if (err)
+        bitsfs_dx_drop(dir);
+}
+
+/*
+ * Release the index extent and fall back to linear directory scans
+ */
+void bitsfs_dx_drop(struct inode *dir)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    struct dx_probe p;
+
+    if (!(bi->i_flags & BITSFS_INDEX_FL))
+        return;
+
+    if (!dx_open(dir, bi->i_dx_block, &p)) {
+        unsigned long blocks = le32_to_cpu(dx_root(&p)->dx_blocks);
+
+        dx_close(&p);
+        dx_free_extent(dir, bi->i_dx_block, blocks);
+    } else {
+        bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Leaking unreadable dir index, ino=%lu block=%u",
+                dir->i_ino, bi->i_dx_block);
+    }
+
+    bi->i_flags &= ~BITSFS_INDEX_FL;
+    bi->i_dx_block = 0;
+    mark_inode_dirty(dir);
+}
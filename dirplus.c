@@ -0,0 +1,189 @@
+#include "bitsfs.h"
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/rcupdate.h>
+#include <linux/buffer_head.h>
+#include <linux/uaccess.h>
+
+/*
+ * Readdir plus attributes, BITSFS_IOC_READDIRPLUS
+ *
+ * Fills a buffer of struct bitsfs_dirent_plus records from the file
+ * position on, like getdents, and adds mode, size, mtime and link count to
+ * each. Those come from the inodes, so they are left zero unless the caller
+ * may search the directory. Cached inodes answer from memory under RCU. For
+ * the others the inode table blocks are sorted, read ahead all at once and
+ * then parsed in block order, so a batch costs a few sequential reads
+ * instead of one dependent bitsfs_iget() per name.
+ */
+
+#define BITSFS_RDP_MAX_BUF      (64 << 10)   /* Records buffered per call */
+
+struct bitsfs_rdp_ctx {
+    struct dir_context ctx;
+    char *buf;
+    unsigned int size;          /* Bytes of buf */
+    unsigned int used;          /* Bytes of records in buf */
+    unsigned int count;         /* Records in buf */
+    int full;                   /* A record did not fit */
+};
+
+struct bitsfs_rdp_slot {
+    unsigned long block;        /* Inode table block */
+    unsigned long offset;       /* Of the inode in it */
+    struct bitsfs_dirent_plus *dp;
+};
+
+static int bitsfs_rdp_fill(struct dir_context *ctx, const char *name, int len,
+        loff_t pos, u64 ino, unsigned int type)
+{
+    struct bitsfs_rdp_ctx *rc = container_of(ctx, struct bitsfs_rdp_ctx, ctx);
+    unsigned int reclen = ALIGN(offsetof(struct bitsfs_dirent_plus, dp_name) + len + 1,
+            sizeof(u64));
+    struct bitsfs_dirent_plus *dp;
+
+    /* stop here, the entry is returned by the next call */
+    if (rc->used + reclen > rc->size) {
+        rc->full = 1;
+        return -EINVAL;
+    }
+
+    dp = (struct bitsfs_dirent_plus *)(rc->buf + rc->used);
+    dp->dp_ino = ino;
+    dp->dp_reclen = reclen;
+    dp->dp_type = type;
+    dp->dp_namelen = len;
+    memcpy(dp->dp_name, name, len);
+    rc->used += reclen;
+    rc->count++;
+    return 0;
+}
+
+/*
+ * Take the attributes of an inode in the inode cache, which may be newer
+ * than its table block
+ */
+static int bitsfs_rdp_cached(struct super_block *sb, struct bitsfs_dirent_plus *dp)
+{
+    struct inode *inode;
+    int found = 0;
+
+    rcu_read_lock();
+    inode = find_inode_by_ino_rcu(sb, dp->dp_ino);
+    if (inode && !(READ_ONCE(inode->i_state) & I_NEW)) {
+        dp->dp_mode = inode->i_mode;
+        dp->dp_nlink = inode->i_nlink;
+        dp->dp_size = i_size_read(inode);
+        dp->dp_mtime = inode->i_mtime.tv_sec;
+        found = 1;
+    }
+    rcu_read_unlock();
+    return found;
+}
+
+static int bitsfs_rdp_slot_cmp(const void *a, const void *b)
+{
+    const struct bitsfs_rdp_slot *x = a, *y = b;
+
+    if (x->block != y->block)
+        return x->block < y->block ? -1 : 1;
+    if (x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Add the attributes to the `count' records in `buf'
+ */
+static int bitsfs_rdp_attrs(struct super_block *sb, char *buf, unsigned int used,
+        unsigned int count)
+{
+    unsigned long inodes = le32_to_cpu(BITFS_S2SI(sb)->s_bs->s_inodes_count);
+    struct bitsfs_rdp_slot *slots;
+    struct bitsfs_dirent_plus *dp;
+    struct buffer_head *bh = NULL;
+    unsigned int off, nr = 0, i;
+    int err = 0;
+
+    slots = kvmalloc_array(count, sizeof(*slots), GFP_KERNEL);
+    if (!slots)
+        return -ENOMEM;
+
+    for (off = 0; off < used; off += dp->dp_reclen) {
+        dp = (struct bitsfs_dirent_plus *)(buf + off);
+        if (dp->dp_ino < BITSFS_ROOT_INO || dp->dp_ino > inodes)
+            continue;
+        if (bitsfs_rdp_cached(sb, dp))
+            continue;
+        slots[nr].block = bitsfs_inode_block(sb, dp->dp_ino, &slots[nr].offset);
+        slots[nr++].dp = dp;
+    }
+
+    sort(slots, nr, sizeof(*slots), bitsfs_rdp_slot_cmp, NULL);
+
+    /* every table block in flight before waiting for the first */
+    for (i = 0; i < nr; i++) {
+        if (!i || slots[i].block != slots[i - 1].block)
+            bitsfs_itable_readahead(sb, slots[i].block);
+    }
+
+    for (i = 0; i < nr; i++) {
+        struct bitsfs_inode *raw_inode;
+        struct bitsfs_inode_extra *ext;
+        struct timespec64 mtime;
+
+        if (!bh || bh->b_blocknr != slots[i].block) {
+            brelse(bh);
+            bh = bitsfs_itable_bread(sb, slots[i].block);
+            if (!bh) {
+                err = -EIO;
+                break;
+            }
+        }
+        raw_inode = (struct bitsfs_inode *)(bh->b_data + slots[i].offset);
+        dp = slots[i].dp;
+        dp->dp_mode = le16_to_cpu(raw_inode->i_mode);
+        dp->dp_nlink = le16_to_cpu(raw_inode->i_links_count);
+        dp->dp_size = le32_to_cpu(raw_inode->i_size);
+        ext = bitsfs_inode_extra(sb, raw_inode);
+        bitsfs_decode_time(&mtime, raw_inode->i_mtime,
+                ext ? &ext->i_mtime_hi : NULL, ext ? &ext->i_mtime_nsec : NULL);
+        dp->dp_mtime = mtime.tv_sec;
+    }
+    brelse(bh);
+    kvfree(slots);
+    return err;
+}
+
+int bitsfs_readdirplus(struct file *file, struct bitsfs_readdirplus *rp)
+{
+    struct inode *dir = file_inode(file);
+    struct bitsfs_rdp_ctx rc = {
+        .ctx.actor = bitsfs_rdp_fill,
+        .size = min_t(u32, rp->rp_size, BITSFS_RDP_MAX_BUF),
+    };
+    int err;
+
+    rc.buf = kvzalloc(rc.size, GFP_KERNEL);
+    if (!rc.buf)
+        return -ENOMEM;
+
+    err = iterate_dir(file, &rc.ctx);
+    if (!err && !rc.count && rc.full)
+        err = -EINVAL;
+    if (!err && rc.count && !inode_permission(dir, MAY_EXEC))
+        err = bitsfs_rdp_attrs(dir->i_sb, rc.buf, rc.used, rc.count);
+    if (!err && copy_to_user(u64_to_user_ptr(rp->rp_buf), rc.buf, rc.used))
+        err = -EFAULT;
+
+    if (!err) {
+        rp->rp_count = rc.count;
+        rp->rp_pos = file->f_pos;
+    }
+    kvfree(rc.buf);
+
+    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Readdirplus, ino=%lu count=%u pos=%lld err=%d",
+            dir->i_ino, rc.count, file->f_pos, err);
+    return err;
+}
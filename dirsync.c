@@ -0,0 +1,164 @@
+#include "bitsfs.h"
+#include <linux/list_sort.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/writeback.h>
+#include <linux/delay.h>
+
+/*
+ * Batched commits of synchronous directory updates
+ *
+ * With -o dirsync every add_link, delete_entry and set_link has
+ * to be on disk before it returns. Instead of writing its page and inode on
+ * its own, an update queues itself on the super block. The first one finds
+ * no commit running and becomes the committer: it takes all the updates
+ * queued by then, writes their directory pages, waits for them, then writes
+ * each inode table block they touch once and waits again. Updates arriving
+ * meanwhile queue for the next commit, whose committer is one of them.
+ *
+ * When the last commit was shared the committer waits a moment for more
+ * updates to join, a lone writer does not pay for it.
+ */
+
+#define BITSFS_DIRSYNC_WINDOW_US    200   /* Commit window after a shared commit */
+
+struct bitsfs_dirsync_req {
+    struct list_head r_list;
+    struct inode *r_dir;
+    unsigned long r_block;      /* Inode table block of r_dir */
+    int r_err;
+    int r_done;
+};
+
+static int bitsfs_dirsync_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+    struct bitsfs_dirsync_req *x = list_entry(a, struct bitsfs_dirsync_req, r_list);
+    struct bitsfs_dirsync_req *y = list_entry(b, struct bitsfs_dirsync_req, r_list);
+
+    if (x->r_block != y->r_block)
+        return x->r_block < y->r_block ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Write the `batch' of updates, the directory pages before the inode table
+ * blocks. Returns the number of updates in *nr.
+ */
+static int bitsfs_dirsync_write(struct super_block *sb, struct list_head *batch,
+        unsigned int *nr)
+{
+    struct bitsfs_dirsync_req *req;
+    struct buffer_head *bh;
+    struct blk_plug plug;
+    unsigned long offset, last;
+    int ret, err = 0;
+
+    *nr = 0;
+    list_for_each_entry(req, batch, r_list) {
+        (*nr)++;
+        /* page 0 of an inline directory lives in its inode table block */
+        if (bitsfs_has_inline_data(req->r_dir))
+            continue;
+        ret = filemap_fdatawrite(req->r_dir->i_mapping);
+        if (ret && !err)
+            err = ret;
+    }
+    list_for_each_entry(req, batch, r_list) {
+        ret = filemap_fdatawait(req->r_dir->i_mapping);
+        if (ret && !err)
+            err = ret;
+    }
+    if (err)
+        return err;
+
+    /* copy the inodes into their table blocks, then write each block once */
+    list_for_each_entry(req, batch, r_list) {
+        ret = sync_inode_metadata(req->r_dir, 1);
+        if (ret && !err)
+            err = ret;
+        req->r_block = bitsfs_inode_block(sb, req->r_dir->i_ino, &offset);
+    }
+    list_sort(NULL, batch, bitsfs_dirsync_cmp);
+
+    last = 0;
+    blk_start_plug(&plug);
+    list_for_each_entry(req, batch, r_list) {
+        if (req->r_block == last)
+            continue;
+        last = req->r_block;
+        bh = sb_getblk(sb, last);
+        write_dirty_buffer(bh, REQ_SYNC);
+        brelse(bh);
+    }
+    blk_finish_plug(&plug);
+    last = 0;
+    list_for_each_entry(req, batch, r_list) {
+        if (req->r_block == last)
+            continue;
+        last = req->r_block;
+        bh = sb_getblk(sb, last);
+        wait_on_buffer(bh);
+        if (!buffer_uptodate(bh) && !err)
+            err = -EIO;
+        brelse(bh);
+    }
+    return err;
+}
+
+/*
+ * Make the last update of directory `dir' durable, together with whatever
+ * other directories are updating at the same time
+ */
+int bitsfs_dirsync(struct inode *dir)
+{
+    struct super_block *sb = dir->i_sb;
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+    struct bitsfs_dirsync_req req = { .r_dir = dir };
+    struct bitsfs_dirsync_req *r;
+    unsigned int nr, shared;
+    LIST_HEAD(batch);
+    int err;
+
+    spin_lock(&sbi->s_dsync_lock);
+    list_add_tail(&req.r_list, &sbi->s_dsync_list);
+    while (!req.r_done) {
+        if (sbi->s_dsync_committing) {
+            spin_unlock(&sbi->s_dsync_lock);
+            wait_event(sbi->s_dsync_wait,
+                    READ_ONCE(req.r_done) || !READ_ONCE(sbi->s_dsync_committing));
+            spin_lock(&sbi->s_dsync_lock);
+            continue;
+        }
+
+        sbi->s_dsync_committing = 1;
+        shared = sbi->s_dsync_last > 1;
+        spin_unlock(&sbi->s_dsync_lock);
+
+        if (shared)
+            usleep_range(BITSFS_DIRSYNC_WINDOW_US, 2 * BITSFS_DIRSYNC_WINDOW_US);
+
+        spin_lock(&sbi->s_dsync_lock);
+        list_splice_init(&sbi->s_dsync_list, &batch);
+        spin_unlock(&sbi->s_dsync_lock);
+
+        err = bitsfs_dirsync_write(sb, &batch, &nr);
+
+        bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
+                "Dirsync commit, updates=%u err=%d", nr, err);
+
+        spin_lock(&sbi->s_dsync_lock);
+        while (!list_empty(&batch)) {
+            r = list_first_entry(&batch, struct bitsfs_dirsync_req, r_list);
+            list_del(&r->r_list);
+            r->r_err = err;
+            WRITE_ONCE(r->r_done, 1);
+        }
+        sbi->s_dsync_last = nr;
+        WRITE_ONCE(sbi->s_dsync_committing, 0);
+        spin_unlock(&sbi->s_dsync_lock);
+        wake_up_all(&sbi->s_dsync_wait);
+        spin_lock(&sbi->s_dsync_lock);
+    }
+    spin_unlock(&sbi->s_dsync_lock);
+    return req.r_err;
+}
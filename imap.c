@@ -0,0 +1,224 @@
+#include "bitsfs.h"
+#include <linux/buffer_head.h>
+
+/*
+ * Inode table chunks allocated on demand
+ *
+ * The inode table mkfs lays out after the inode bitmap holds the first
+ * bitsfs_static_inodes() inodes. When they are all in use, new_inode adds a
+ * chunk of BITSFS_ICHUNK_BLOCKS contiguous blocks from data space and the
+ * inode numbers after the last ones go there. A map block, allocated with
+ * the first chunk and found through s_imap_block, keeps the first block of
+ * every chunk in inode number order, and the inode bitmap blocks past the
+ * first one, each added when the inode count outgrows the bitmaps.
+ *
+ * A chunk is zeroed on disk before the map points to it and the map is on
+ * disk before s_inodes_count takes its inodes in, so after a crash the map
+ * may be one chunk ahead of the super block: the mount then takes the
+ * zeroed chunk in. Chunks are never given back. The first chunk sets the
+ * dyninode incompat feature.
+ */
+
+static struct bitsfs_imap *bitsfs_imap(struct super_block *sb)
+{
+    return (struct bitsfs_imap *)BITFS_S2SI(sb)->s_imap_bh->b_data;
+}
+
+/*
+ * Read the map at mount, caller releases sbi->s_imap_bh
+ */
+int bitsfs_imap_load(struct super_block *sb)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+    struct bitsfs_super_block *bs = sbi->s_bs;
+    unsigned long block = le32_to_cpu(bs->s_imap_block);
+    unsigned long per_chunk = bitsfs_chunk_inodes(sb);
+    unsigned long inodes = le32_to_cpu(bs->s_inodes_count);
+    struct bitsfs_imap *imap;
+    unsigned long chunks;
+
+    if (!block) {
+        if (le32_to_cpu(bs->s_inodes_count) > bitsfs_static_inodes(sb))
+            goto corrupt;
+        return 0;
+    }
+
+    sbi->s_imap_bh = sb_bread(sb, block);
+    if (!sbi->s_imap_bh) {
+        bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Cannot read inode chunk map, block=%lu", block);
+        return -EIO;
+    }
+
+    imap = bitsfs_imap(sb);
+    chunks = le32_to_cpu(imap->im_chunks);
+    if (le32_to_cpu(imap->im_magic) != BITSFS_IMAP_MAGIC || chunks > BITSFS_IMAP_CHUNKS)
+        goto corrupt;
+    if (inodes == bitsfs_static_inodes(sb) + chunks * per_chunk)
+        return 0;
+    if (!chunks || inodes != bitsfs_static_inodes(sb) + (chunks - 1) * per_chunk)
+        goto corrupt;
+
+    /* a crash in bitsfs_imap_grow() between the map and the super block */
+    bitsfs_msg(sb, KERN_WARNING, __func__, __FILE__, __LINE__,
+            "Taking in inode table chunk %lu left by a crash, inodes=%lu",
+            chunks - 1, inodes + per_chunk);
+    bs->s_feature_incompat |= cpu_to_le32(BITSFS_FEATURE_INCOMPAT_DYNINODE);
+    le32_add_cpu(&bs->s_free_inodes_count, per_chunk);
+    bs->s_inodes_count = cpu_to_le32(inodes + per_chunk);
+    if (!sb_rdonly(sb))
+        mark_buffer_dirty(sbi->s_sbh);
+    return 0;
+corrupt:
+    bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+            "Corrupt inode chunk map, block=%lu inodes=%u",
+            block, le32_to_cpu(bs->s_inodes_count));
+    return -EINVAL;
+}
+
+/*
+ * Table block of inode `ino' past the static table and its offset in there
+ */
+unsigned long bitsfs_imap_block(struct super_block *sb, ino_t ino, unsigned long *offset)
+{
+    unsigned long n = ino - 1 - bitsfs_static_inodes(sb);
+    unsigned long per_chunk = bitsfs_chunk_inodes(sb);
+    unsigned long byte = (n % per_chunk) * BITFS_S2SI(sb)->s_inode_size;
+
+    *offset = byte % BITSFS_BLOCK_SIZE;
+    return le32_to_cpu(bitsfs_imap(sb)->im_chunk[n / per_chunk]) + byte / BITSFS_BLOCK_SIZE;
+}
+
+/*
+ * Block of inode bitmap `k' past the first one, 0 when not added yet
+ */
+unsigned long bitsfs_imap_bitmap(struct super_block *sb, unsigned long k)
+{
+    if (!BITFS_S2SI(sb)->s_imap_bh || k > BITSFS_IMAP_BITMAPS)
+        return 0;
+    return le32_to_cpu(bitsfs_imap(sb)->im_bitmap[k - 1]);
+}
+
+/*
+ * Allocate `count' blocks for inode metadata, write them as zero and
+ * write the block bitmap that claims them
+ */
+static int bitsfs_imap_new_blocks(struct inode *dir, int count, unsigned long *block)
+{
+    struct super_block *sb = dir->i_sb;
+    struct buffer_head *bh;
+    int i, err;
+
+    err = bitsfs_new_blocks(dir, count, block);
+    if (err)
+        return err;
+
+    for (i = 0; i < count; i++) {
+        bh = sb_getblk(sb, *block + i);
+        lock_buffer(bh);
+        memset(bh->b_data, 0, bh->b_size);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        write_dirty_buffer(bh, REQ_SYNC);
+        brelse(bh);
+    }
+    for (i = 0; i < count; i++) {
+        bh = sb_getblk(sb, *block + i);
+        wait_on_buffer(bh);
+        if (!buffer_uptodate(bh))
+            err = -EIO;
+        brelse(bh);
+    }
+    /* the map must not reach disk before the bits that claim its blocks */
+    if (!err)
+        err = bitsfs_sync_block_bitmap(sb);
+    if (err)
+        bitsfs_free_blocks(dir, *block, count);
+    return err;
+}
+
+/*
+ * Add a chunk of inodes, new_inode found all `count' inodes in use.
+ * Returns 0 also when someone else added one meanwhile.
+ */
+int bitsfs_imap_grow(struct inode *dir, unsigned long count)
+{
+    struct super_block *sb = dir->i_sb;
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+    struct bitsfs_super_block *bs = sbi->s_bs;
+    unsigned long per_chunk = bitsfs_chunk_inodes(sb);
+    unsigned long chunks, k, block, bitmap = 0;
+    struct bitsfs_imap *imap;
+    int err = 0;
+
+    mutex_lock(&sbi->s_imap_mutex);
+    if (le32_to_cpu(bs->s_inodes_count) != count)
+        goto out;
+
+    if (!sbi->s_imap_bh) {
+        err = bitsfs_imap_new_blocks(dir, 1, &block);
+        if (err)
+            goto out;
+        sbi->s_imap_bh = sb_getblk(sb, block);
+        bitsfs_imap(sb)->im_magic = cpu_to_le32(BITSFS_IMAP_MAGIC);
+        bs->s_imap_block = cpu_to_le32(block);
+    }
+
+    imap = bitsfs_imap(sb);
+    chunks = le32_to_cpu(imap->im_chunks);
+    k = (count + per_chunk - 1) / BITSFS_INODES_PER_BITMAP;
+    if (chunks >= BITSFS_IMAP_CHUNKS || k > BITSFS_IMAP_BITMAPS) {
+        err = -ENOSPC;
+        goto out;
+    }
+
+    /* the new inodes start a bitmap block */
+    if (k && !imap->im_bitmap[k - 1]) {
+        err = bitsfs_imap_new_blocks(dir, 1, &bitmap);
+        if (err)
+            goto out;
+    }
+
+    err = bitsfs_imap_new_blocks(dir, BITSFS_ICHUNK_BLOCKS, &block);
+    if (err)
+        goto fail;
+
+    if (bitmap)
+        imap->im_bitmap[k - 1] = cpu_to_le32(bitmap);
+    imap->im_chunk[chunks] = cpu_to_le32(block);
+    imap->im_chunks = cpu_to_le32(chunks + 1);
+    mark_buffer_dirty(sbi->s_imap_bh);
+    err = sync_dirty_buffer(sbi->s_imap_bh);
+    if (err) {
+        /* the next sync writes the map without them */
+        imap->im_chunks = cpu_to_le32(chunks);
+        imap->im_chunk[chunks] = 0;
+        if (bitmap)
+            imap->im_bitmap[k - 1] = 0;
+        mark_buffer_dirty(sbi->s_imap_bh);
+        bitsfs_free_blocks(dir, block, BITSFS_ICHUNK_BLOCKS);
+        goto fail;
+    }
+
+    bs->s_feature_incompat |= cpu_to_le32(BITSFS_FEATURE_INCOMPAT_DYNINODE);
+    le32_add_cpu(&bs->s_free_inodes_count, per_chunk);
+    /* lookups of the new inode numbers see the map entry */
+    smp_wmb();
+    WRITE_ONCE(bs->s_inodes_count, cpu_to_le32(count + per_chunk));
+    sbi->s_inodes_count = count + per_chunk;
+    mark_buffer_dirty(sbi->s_sbh);
+    err = sync_dirty_buffer(sbi->s_sbh);
+    percpu_counter_add(&sbi->s_freeinodes_counter, per_chunk);
+
+    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Added inode table chunk %lu at block %lu, inodes=%lu",
+            chunks, block, count + per_chunk);
+    goto out;
+fail:
+    if (bitmap)
+        bitsfs_free_blocks(dir, bitmap, 1);
+out:
+    mutex_unlock(&sbi->s_imap_mutex);
+    return err;
+}
@@ -0,0 +1,126 @@
+#include "bitsfs.h"
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/buffer_head.h>
+
+/*
+ * Inline directories
+ *
+ * On a file system made with inodes larger than 128 bytes (mkfs -I), a new
+ * directory keeps its entries in the tail of its on-disk inode instead of a
+ * block and is flagged BITSFS_INLINE_DATA_FL. To dentry.c it still is a one
+ * page directory: readpage fills page 0 from the inode and committing a
+ * chunk copies the page back. The first commit that leaves entries past the
+ * inline area moves the directory to a block for good.
+ */
+
+static void *bitsfs_inline_data(struct bitsfs_inode *raw_inode)
+{
+    return (char *)raw_inode + BITSFS_GOOD_OLD_INODE_SIZE + BITSFS_INODE_EXTRA;
+}
+
+/*
+ * Make new directory `dir' inline if its inode holds "." and ".." plus a
+ * couple of short names
+ */
+void bitsfs_inline_dir_init(struct inode *dir)
+{
+    struct super_block *sb = dir->i_sb;
+
+    if (bitsfs_inline_size(sb) >= 4 * bitsfs_dent_used(sb, 2))
+        BITSFS_I2BI(dir)->i_flags |= BITSFS_INLINE_DATA_FL;
+}
+
+/*
+ * readpage of an inline directory
+ */
+int bitsfs_read_inline_page(struct inode *inode, struct page *page)
+{
+    unsigned size = page->index ? 0 : bitsfs_inline_size(inode->i_sb);
+    struct bitsfs_inode *raw_inode;
+    struct buffer_head *bh;
+    void *kaddr;
+
+    raw_inode = bitsfs_read_inode(inode->i_sb, inode->i_ino, &bh);
+    if (IS_ERR(raw_inode)) {
+        SetPageError(page);
+        unlock_page(page);
+        return PTR_ERR(raw_inode);
+    }
+
+    kaddr = kmap_atomic(page);
+    memcpy(kaddr, bitsfs_inline_data(raw_inode), size);
+    memset((char *)kaddr + size, 0, PAGE_SIZE - size);
+    flush_dcache_page(page);
+    kunmap_atomic(kaddr);
+    brelse(bh);
+
+    SetPageUptodate(page);
+    unlock_page(page);
+    return 0;
+}
+
+/*
+ * Give inline directory `dir' a block for page 0, which stays locked and
+ * is written like the page of any directory from now on
+ */
+static int bitsfs_convert_inline(struct inode *dir, struct page *page)
+{
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(dir);
+    int err;
+
+    if (page->index) {
+        bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Inline directory write past page 0, ino=%lu", dir->i_ino);
+        return -EIO;
+    }
+
+    bi->i_flags &= ~BITSFS_INLINE_DATA_FL;
+    SetPageUptodate(page);
+    err = __block_write_begin(page, 0, PAGE_SIZE, bitsfs_get_block);
+    if (err) {
+        bi->i_flags |= BITSFS_INLINE_DATA_FL;
+        /* the inode does not have the new entries, read them again */
+        ClearPageUptodate(page);
+        return err;
+    }
+    mark_inode_dirty(dir);
+
+    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Moved inline directory to a block, ino=%lu", dir->i_ino);
+    return 0;
+}
+
+/*
+ * Store page 0 of inline directory `dir' in its inode, the caller holds the
+ * page lock. Entries past the inline area convert the directory instead, the
+ * caller then goes on with the page as for a block backed directory.
+ */
+int bitsfs_write_inline_page(struct inode *dir, struct page *page)
+{
+    unsigned size = bitsfs_inline_size(dir->i_sb);
+    struct bitsfs_inode *raw_inode;
+    struct buffer_head *bh;
+    void *kaddr;
+    int fits;
+
+    kaddr = kmap_atomic(page);
+    fits = !page->index && !memchr_inv((char *)kaddr + size, 0, PAGE_SIZE - size);
+    kunmap_atomic(kaddr);
+    if (!fits)
+        return bitsfs_convert_inline(dir, page);
+
+    raw_inode = bitsfs_read_inode(dir->i_sb, dir->i_ino, &bh);
+    if (IS_ERR(raw_inode))
+        return PTR_ERR(raw_inode);
+
+    kaddr = kmap_atomic(page);
+    memcpy(bitsfs_inline_data(raw_inode), kaddr, size);
+    kunmap_atomic(kaddr);
+    SetPageUptodate(page);
+
+    /* written by bitsfs_dirsync() with dirsync, by writeback otherwise */
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    return 0;
+}
@@ -12,17 +12,24 @@
 #include <linux/iomap.h>
 #include <linux/namei.h>
 #include <linux/uio.h>
+#include "bitsfs_trace.h"
 
 void bitsfs_set_file_ops(struct inode *inode);
 void bitsfs_set_dir_ops(struct inode *inode);
 
-static struct buffer_head* read_inode_bitmap(struct super_block *sb)
+/*
+ * Read inode bitmap `k', of the inodes from k * BITSFS_INODES_PER_BITMAP + 1 on
+ */
+struct buffer_head* read_inode_bitmap(struct super_block *sb, unsigned long k)
 {
     struct buffer_head *bh = NULL;
-    bh = sb_bread(sb, le32_to_cpu(BITSFS_INDBMP_BLOCK));
+    unsigned long block = k ? bitsfs_imap_bitmap(sb, k) : BITSFS_INDBMP_BLOCK;
+
+    if (block)
+        bh = sb_bread(sb, block);
     if (!bh)
         bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
-                "Cannot read inode bitmap");
+                "Cannot read inode bitmap %lu", k);
     return bh;
 }
 
@@ -30,44 +37,47 @@ void set_root_inode_bitmap(struct inode *inode, int pos)
 {
     int ret;
     struct buffer_head *bh;
-    bh = read_inode_bitmap(inode->i_sb);
+    bh = read_inode_bitmap(inode->i_sb, 0);
     ret = bitsfs_set_bit(pos, bh->b_data);
     bitsfs_msg(inode->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
             "Set root inode bitmap pos=%d, ret=%d", pos, ret);
     brelse(bh);
 }
 
-static struct bitsfs_inode *bitsfs_read_inode(struct super_block *sb, ino_t ino,
+/*
+ * Inode table block of inode `ino' and its offset in there
+ */
+unsigned long bitsfs_inode_block(struct super_block *sb, ino_t ino, unsigned long *offset)
+{
+    struct bitsfs_super_block *bs = BITFS_S2SI(sb)->s_bs;
+
+    if (ino > bitsfs_static_inodes(sb))
+        return bitsfs_imap_block(sb, ino, offset);
+    *offset = bs->s_inode_size * (ino - 1) % BITSFS_BLOCK_SIZE;
+    return BITSFS_INDTBL_BLOCK + bs->s_inode_size * (ino - 1) / BITSFS_BLOCK_SIZE;
+}
+
+struct bitsfs_inode *bitsfs_read_inode(struct super_block *sb, ino_t ino,
                     struct buffer_head **p)
 {
     unsigned long block;
     unsigned long offset;
     struct buffer_head *bh;
     struct bitsfs_inode *raw_inode;
-    struct bitsfs_super_block *bs = BITFS_S2SI(sb)->s_bs;
 
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "Read inode from disk start, ino=%lu", ino);
-            
     *p = NULL;
-    if (ino != BITSFS_ROOT_INO && ino < BITSFS_ROOT_INO)
+    if ((ino != BITSFS_ROOT_INO && ino < BITSFS_ROOT_INO) ||
+            ino > le32_to_cpu(READ_ONCE(BITFS_S2SI(sb)->s_bs->s_inodes_count)))
         goto Einval;
 
-    block = bs->s_inode_size * (ino - 1) / BITSFS_BLOCK_SIZE;
-    offset = bs->s_inode_size * (ino - 1) % BITSFS_BLOCK_SIZE;
-
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "Read inode from disk, block=%lu offset=%lu", block, offset);
+    block = bitsfs_inode_block(sb, ino, &offset);
 
     /* Read block from buff */
-    if (!(bh = sb_bread(sb, BITSFS_INDTBL_BLOCK + block)))
+    if (!(bh = bitsfs_itable_bread(sb, block)))
         goto Eio;
 
     *p = bh;
     raw_inode = (struct bitsfs_inode*)(bh->b_data + offset);
-
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "Read inode from disk end, ino=%lu raw_inode=%p", ino, raw_inode);
     return raw_inode;
 Einval:
     bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__, 
@@ -82,25 +92,33 @@ Eio:
 
 int bitsfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
-    int n, err = 0;
+    int n, changed, err = 0;
     ino_t ino = inode->i_ino;
     struct bitsfs_inode_info *bi = BITSFS_I2BI(inode);
     struct super_block *sb = inode->i_sb;
     struct buffer_head * bh;
+    struct bitsfs_inode_extra *ext;
+    char old[BITSFS_GOOD_OLD_INODE_SIZE + BITSFS_INODE_EXTRA];
+    size_t len;
 
     /* inode on disk */
     struct bitsfs_inode *raw_inode = bitsfs_read_inode(sb, ino, &bh);
 
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-           "Write inode start, ino=%lu, i_block=%p",
-           (unsigned long)ino, bi->i_data);
+    if (IS_ERR(raw_inode))
+        return PTR_ERR(raw_inode);
+    ext = bitsfs_inode_extra(sb, raw_inode);
+    len = ext ? sizeof(old) : BITSFS_GOOD_OLD_INODE_SIZE;
+    memcpy(old, raw_inode, len);
 
     raw_inode->i_mode = cpu_to_le16(inode->i_mode);
     raw_inode->i_links_count = cpu_to_le16(inode->i_nlink);
     raw_inode->i_size = cpu_to_le32(inode->i_size);
-    raw_inode->i_atime = cpu_to_le32(inode->i_atime.tv_sec);
-    raw_inode->i_ctime = cpu_to_le32(inode->i_ctime.tv_sec);
-    raw_inode->i_mtime = cpu_to_le32(inode->i_mtime.tv_sec);
+    bitsfs_encode_time(&inode->i_atime, &raw_inode->i_atime,
+            ext ? &ext->i_atime_hi : NULL, ext ? &ext->i_atime_nsec : NULL);
+    bitsfs_encode_time(&inode->i_ctime, &raw_inode->i_ctime,
+            ext ? &ext->i_ctime_hi : NULL, ext ? &ext->i_ctime_nsec : NULL);
+    bitsfs_encode_time(&inode->i_mtime, &raw_inode->i_mtime,
+            ext ? &ext->i_mtime_hi : NULL, ext ? &ext->i_mtime_nsec : NULL);
 
     raw_inode->i_blocks = cpu_to_le32(inode->i_blocks);
     raw_inode->i_dtime = cpu_to_le32(bi->i_dtime);
@@ -112,17 +130,66 @@ int bitsfs_write_inode(struct inode *inode, struct writeback_control *wbc)
     
     for (n = 0; n < BITSFS_TMAX_BLOCKS; n++)
         raw_inode->i_block[n] = bi->i_data[n];
-
-    mark_buffer_dirty(bh);
+    raw_inode->i_dx_block = cpu_to_le32(bi->i_dx_block);
+    raw_inode->i_dir_holes = cpu_to_le32(bi->i_dir_holes);
+    raw_inode->i_dir_entries = cpu_to_le32(bi->i_dir_entries);
+    raw_inode->i_next_orphan = cpu_to_le32(bi->i_next_orphan);
+
+    /* e.g. a lazytime update that the block already holds */
+    changed = memcmp(old, raw_inode, len) != 0;
+    if (changed) {
+        mark_buffer_dirty(bh);
+        bitsfs_itable_dirty(sb, ino);
+    }
     bi->i_state &= ~BITSFS_STATE_NEW;
 
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-           "Write inode end, ino=%lu i_state=%d", ino, bi->i_state);
-    
+    trace_bitsfs_write_inode(inode, changed, wbc && wbc->sync_mode == WB_SYNC_ALL, err);
     brelse (bh);
     return err;
 }
 
+/*
+ * Take a free inode number, adding an inode table chunk when all are in use
+ */
+static int bitsfs_alloc_ino(struct inode *dir, ino_t *ino)
+{
+    struct super_block *sb = dir->i_sb;
+    struct bitsfs_super_block *bs = BITFS_S2SI(sb)->s_bs;
+    unsigned long count, k, bit, end;
+    struct buffer_head *bh;
+    int err;
+
+    for (;;) {
+        count = le32_to_cpu(READ_ONCE(bs->s_inodes_count));
+        for (k = 0; k * BITSFS_INODES_PER_BITMAP < count; k++) {
+            bh = read_inode_bitmap(sb, k);
+            if (!bh)
+                return -EIO;
+            end = min_t(unsigned long, count - k * BITSFS_INODES_PER_BITMAP,
+                    BITSFS_INODES_PER_BITMAP);
+            bit = k ? 0 : BITSFS_ROOT_INO - 1;
+            for (; (bit = bitsfs_find_next_zero_bit(bh->b_data, end, bit)) < end; bit++) {
+                if (!bitsfs_set_bit(bit, bh->b_data))
+                    goto found;
+            }
+            brelse(bh);
+        }
+        err = bitsfs_imap_grow(dir, count);
+        if (err)
+            return err;
+    }
+found:
+    *ino = k * BITSFS_INODES_PER_BITMAP + bit + 1;
+    /* a lazily initialized table block is zeroed before it gets inodes */
+    err = bitsfs_itable_init(sb, *ino);
+    if (err)
+        bitsfs_clear_bit(bit, bh->b_data);
+    else
+        mark_buffer_dirty(bh);
+    brelse(bh);
+    return err;
+}
+
 struct inode *bitsfs_new_inode(struct inode *dir, umode_t mode,
                  const struct qstr *qstr)
 {
@@ -131,13 +198,9 @@ struct inode *bitsfs_new_inode(struct inode *dir, umode_t mode,
     struct bitsfs_inode_info *ei;
     struct super_block *sb;
     struct bitsfs_sb_info *sbi;
-    struct bitsfs_super_block *bs;
-    struct buffer_head *bitmap_bh = NULL;
     int err;
 
     sb = dir->i_sb;
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "New inode start, child_name=%s", qstr->name);
 
     inode = new_inode(sb);
     if (!inode)
@@ -145,19 +208,10 @@ struct inode *bitsfs_new_inode(struct inode *dir, umode_t mode,
 
     ei = BITSFS_I2BI(inode);
     sbi = BITSFS_B2BI(sb);
-    bs = sbi->s_bs;
-    
-    bitmap_bh = read_inode_bitmap(sb);
-    ino = bitsfs_find_next_zero_bit((unsigned long *)bitmap_bh->b_data, bs->s_inodes_count, BITSFS_ROOT_INO - 1);
-    bitsfs_set_bit(ino, bitmap_bh->b_data);
-
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-           "New inode start got next zero bit, pos=%lu inodes_count=%lu offset=%d", 
-           ino, bs->s_inodes_count, (BITSFS_ROOT_INO - 1));
-  
-    ino += 1;
-    mark_buffer_dirty(bitmap_bh);
-    brelse(bitmap_bh);
+
+    err = bitsfs_alloc_ino(dir, &ino);
+    if (err)
+        goto fail;
 
     percpu_counter_dec(&sbi->s_freeinodes_counter);
     if (S_ISDIR(mode))
@@ -170,9 +224,14 @@ struct inode *bitsfs_new_inode(struct inode *dir, umode_t mode,
     inode->i_blocks = 0;
     inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
     memset(ei->i_data, 0, sizeof(ei->i_data));
+    ei->i_flags = 0;
     ei->i_file_acl = 0;
     ei->i_dir_acl = 0;
     ei->i_dtime = 0;
+    ei->i_dx_block = 0;
+    ei->i_dir_holes = 0;
+    ei->i_dir_entries = 0;
+    ei->i_dir_start_lookup = 0;
     ei->i_state = BITSFS_STATE_NEW;
     if (insert_inode_locked(inode) < 0) {
         bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__, 
@@ -181,27 +240,50 @@ struct inode *bitsfs_new_inode(struct inode *dir, umode_t mode,
         goto fail;
     }
     mark_inode_dirty(inode);
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "New inode start end, ino=%lu, i_state=%d, i_mode=%d", 
-            inode->i_ino, inode->i_state, inode->i_mode);
+    trace_bitsfs_new_inode(sb, ino, 0);
     return inode;
 fail:
+    trace_bitsfs_new_inode(sb, ino, err);
     make_bad_inode(inode);
     iput(inode);
     return ERR_PTR(err);
 }
 
+/*
+ * Take a reference on a cached, fully read inode without the inode hash
+ * lock, so parallel lookups of different files do not meet there
+ */
+static struct inode *bitsfs_iget_cached(struct super_block *sb, unsigned long ino)
+{
+    struct inode *inode;
+
+    rcu_read_lock();
+    inode = find_inode_by_ino_rcu(sb, ino);
+    if (inode)
+        inode = igrab(inode);
+    rcu_read_unlock();
+
+    /* still being read in, iget_locked() waits for it */
+    if (inode && unlikely(READ_ONCE(inode->i_state) & I_NEW)) {
+        iput(inode);
+        inode = NULL;
+    }
+    return inode;
+}
+
 struct inode *bitsfs_iget (struct super_block *sb, unsigned long ino)
 {
     int n;
     struct inode *inode;
     struct bitsfs_inode_info *bi;
     struct bitsfs_inode *raw_inode;
+    struct bitsfs_inode_extra *ext;
     struct buffer_head *bh = NULL;
     long ret = -EIO;
 
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "Get inode start, ino=%lu", ino);
+    inode = bitsfs_iget_cached(sb, ino);
+    if (inode)
+        return inode;
 
     inode = iget_locked(sb, ino);
     if (!inode)
@@ -217,25 +299,27 @@ struct inode *bitsfs_iget (struct super_block *sb, unsigned long ino)
          goto bad_inode;
     }
 
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "Get inode read inode, raw_inode=%p link_count=%d", raw_inode, raw_inode->i_links_count);
-
     inode->i_mode = le16_to_cpu(raw_inode->i_mode);
     set_nlink(inode, le16_to_cpu(raw_inode->i_links_count));
     inode->i_size = le32_to_cpu(raw_inode->i_size);
-    inode->i_atime.tv_sec = (signed)le32_to_cpu(raw_inode->i_atime);
-    inode->i_ctime.tv_sec = (signed)le32_to_cpu(raw_inode->i_ctime);
-    inode->i_mtime.tv_sec = (signed)le32_to_cpu(raw_inode->i_mtime);
-    inode->i_atime.tv_nsec = inode->i_mtime.tv_nsec = inode->i_ctime.tv_nsec = 0;
+    ext = bitsfs_inode_extra(sb, raw_inode);
+    bitsfs_decode_time(&inode->i_atime, raw_inode->i_atime,
+            ext ? &ext->i_atime_hi : NULL, ext ? &ext->i_atime_nsec : NULL);
+    bitsfs_decode_time(&inode->i_ctime, raw_inode->i_ctime,
+            ext ? &ext->i_ctime_hi : NULL, ext ? &ext->i_ctime_nsec : NULL);
+    bitsfs_decode_time(&inode->i_mtime, raw_inode->i_mtime,
+            ext ? &ext->i_mtime_hi : NULL, ext ? &ext->i_mtime_nsec : NULL);
     inode->i_blocks = le32_to_cpu(raw_inode->i_blocks);
 
+    /* an unlinked inode without dtime is an orphan still to be deleted */
+    bi->i_dtime = le32_to_cpu(raw_inode->i_dtime);
     if (inode->i_nlink == 0 && (inode->i_mode == 0 || bi->i_dtime)) {
         /* this inode is deleted */
         ret = -ESTALE;
         goto bad_inode;
     }
 
-    bi->i_dtime = le32_to_cpu(raw_inode->i_dtime);
+    bi->i_next_orphan = le32_to_cpu(raw_inode->i_next_orphan);
     bi->i_flags = le32_to_cpu(raw_inode->i_flags);
     bi->i_file_acl = le32_to_cpu(raw_inode->i_file_acl);
     bi->i_dir_acl = 0;
@@ -245,8 +329,12 @@ struct inode *bitsfs_iget (struct super_block *sb, unsigned long ino)
 
     bi->i_state = 0;
 
-    for (n = 0; n < BITSFS_NDIR_BLOCKS; n++)
+    for (n = 0; n < BITSFS_TMAX_BLOCKS; n++)
         bi->i_data[n] = raw_inode->i_block[n];
+    bi->i_dx_block = le32_to_cpu(raw_inode->i_dx_block);
+    bi->i_dir_holes = le32_to_cpu(raw_inode->i_dir_holes);
+    bi->i_dir_entries = le32_to_cpu(raw_inode->i_dir_entries);
+    bi->i_dir_start_lookup = 0;
 
     if (S_ISREG(inode->i_mode)) {
         bitsfs_set_file_ops(inode);
@@ -254,14 +342,12 @@ struct inode *bitsfs_iget (struct super_block *sb, unsigned long ino)
         bitsfs_set_dir_ops(inode);
     }
 
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
-            "Get inode end, ino=%lu i_state=%lu, i_mode=%d",
-            inode->i_ino, inode->i_state, S_ISDIR(inode->i_mode));
-    
+    trace_bitsfs_iget(sb, ino, 0);
     brelse (bh);
     unlock_new_inode(inode);
     return inode;
 bad_inode:
+    trace_bitsfs_iget(sb, ino, ret);
     brelse(bh);
     iget_failed(inode);
     return ERR_PTR(ret);
@@ -275,12 +361,15 @@ void bitsfs_free_inode (struct inode * inode)
 
     ino = inode->i_ino;
 
-    bitmap_bh = read_inode_bitmap(sb);
-    if (!bitmap_bh)
+    bitmap_bh = read_inode_bitmap(sb, (ino - 1) / BITSFS_INODES_PER_BITMAP);
+    if (!bitmap_bh) {
+        trace_bitsfs_free_inode(sb, ino, -EIO);
         return;
+    }
+    trace_bitsfs_free_inode(sb, ino, 0);
 
     /* update inode bitmaps */
-    if (!test_and_clear_bit_le(ino-1, (void*)bitmap_bh->b_data))
+    if (!test_and_clear_bit_le((ino - 1) % BITSFS_INODES_PER_BITMAP, (void*)bitmap_bh->b_data))
         bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
             "Free inode, bit already cleared for inode %lu", ino);
     mark_buffer_dirty(bitmap_bh);
@@ -291,27 +380,26 @@ void bitsfs_evict_inode(struct inode *inode)
 {
     int do_delete = 0;
     struct bitsfs_inode_info *bi;
-    struct address_space* mapping = &inode->i_data;
 
     bi = BITSFS_I2BI(inode);
-
-    bitsfs_msg(inode->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
-            "Evict inode start, ino=%lu", inode->i_ino);
-    
-    bitsfs_msg(inode->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
-            "Evict inode show, ino=%lu i_data=%p private_data=%p nrpages=%d i_state=%lu i_freeing=%d i_clear=%d", 
-            inode->i_ino, inode->i_data, mapping->private_data, mapping->nrpages, 
-            inode->i_state, (inode->i_state & I_FREEING), (inode->i_state & I_CLEAR));
+    trace_bitsfs_evict_inode(inode->i_sb, inode->i_ino, 0);
 
     if (!inode->i_nlink && !is_bad_inode(inode)) {
         do_delete = 1;
     }
 
     truncate_inode_pages_final(&inode->i_data);
+    if (S_ISDIR(inode->i_mode)) {
+        bitsfs_dcache_drop(inode);
+        bitsfs_bloom_drop(inode);
+        bitsfs_dir_holes_drop(inode);
+    }
     if (do_delete) {
          sb_start_intwrite(inode->i_sb);
         /* set dtime */
         bi->i_dtime = ktime_get_real_seconds();
+        if (S_ISDIR(inode->i_mode))
+            bitsfs_dx_drop(inode);
         mark_inode_dirty(inode);
         bitsfs_write_inode(inode, NULL);
         /* truncate to 0 */
@@ -319,13 +407,13 @@ void bitsfs_evict_inode(struct inode *inode)
         if (inode->i_blocks)
             bitsfs_truncate_blocks(inode, 0);
     }
+    /* before the inode number can be reused */
+    if (!list_empty(&bi->i_orphan))
+        bitsfs_orphan_del(inode);
 
     invalidate_inode_buffers(inode);
     clear_inode(inode);
 
-    bitsfs_msg(inode->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
-            "Evict inode end, ino=%lu", inode->i_ino);
-
     if (do_delete) {
         bitsfs_free_inode(inode);
         sb_end_intwrite(inode->i_sb);
@@ -356,6 +444,10 @@ const struct file_operations bitsfs_file_operations = {
     .mmap          = generic_file_mmap,
     .open          = generic_file_open,
     .fsync         = generic_file_fsync,
+    .unlocked_ioctl = bitsfs_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl  = bitsfs_compat_ioctl,
+#endif
     .get_unmapped_area = thp_get_unmapped_area,
     .splice_read   = generic_file_splice_read,
     .splice_write  = iter_file_splice_write,
@@ -0,0 +1,99 @@
+#include "bitsfs.h"
+#include <linux/capability.h>
+#include <linux/time.h>
+#include <linux/sched.h>
+#include <linux/compat.h>
+#include <linux/mount.h>
+#include <linux/uaccess.h>
+
+long bitsfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct inode *inode = file_inode(filp);
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(inode);
+    unsigned int flags;
+    int ret;
+
+    switch (cmd) {
+    case FS_IOC_GETFLAGS:
+        flags = bi->i_flags & BITSFS_FL_USER_VISIBLE;
+        return put_user(flags, (int __user *) arg);
+    case BITSFS_IOC_COMPACT_DIR:
+        if (!S_ISDIR(inode->i_mode))
+            return -ENOTDIR;
+        if (!inode_owner_or_capable(inode))
+            return -EACCES;
+
+        ret = mnt_want_write_file(filp);
+        if (ret)
+            return ret;
+
+        inode_lock(inode);
+        ret = bitsfs_compact_dir(inode);
+        inode_unlock(inode);
+
+        bitsfs_msg(inode->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
+                "Compact dir, ino=%lu size=%lld ret=%d",
+                inode->i_ino, inode->i_size, ret);
+        mnt_drop_write_file(filp);
+        return ret;
+    case BITSFS_IOC_BLOOM_STATS: {
+        struct bitsfs_bloom_stats st;
+
+        if (!S_ISDIR(inode->i_mode))
+            return -ENOTDIR;
+
+        bitsfs_bloom_stats(inode, &st);
+        if (copy_to_user((struct bitsfs_bloom_stats __user *) arg, &st, sizeof(st)))
+            return -EFAULT;
+        return 0;
+    }
+    case BITSFS_IOC_READDIRPLUS: {
+        struct bitsfs_readdirplus rp;
+
+        if (!S_ISDIR(inode->i_mode))
+            return -ENOTDIR;
+        if (copy_from_user(&rp, (struct bitsfs_readdirplus __user *) arg, sizeof(rp)))
+            return -EFAULT;
+
+        ret = bitsfs_readdirplus(filp, &rp);
+        if (!ret && copy_to_user((struct bitsfs_readdirplus __user *) arg, &rp, sizeof(rp)))
+            ret = -EFAULT;
+        return ret;
+    }
+    case BITSFS_IOC_BULKSTAT: {
+        struct bitsfs_bulkstat br;
+
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&br, (struct bitsfs_bulkstat __user *) arg, sizeof(br)))
+            return -EFAULT;
+
+        ret = bitsfs_bulkstat(inode->i_sb, &br);
+        if (!ret && copy_to_user((struct bitsfs_bulkstat __user *) arg, &br, sizeof(br)))
+            ret = -EFAULT;
+        return ret;
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+
+#ifdef CONFIG_COMPAT
+long bitsfs_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    /* These are just misnamed, they actually get/put from/to user an int */
+    switch (cmd) {
+    case FS_IOC32_GETFLAGS:
+        cmd = FS_IOC_GETFLAGS;
+        break;
+    case BITSFS_IOC_COMPACT_DIR:
+    case BITSFS_IOC_BLOOM_STATS:
+    case BITSFS_IOC_READDIRPLUS:
+    case BITSFS_IOC_BULKSTAT:
+        break;
+    default:
+        return -ENOIOCTLCMD;
+    }
+    return bitsfs_ioctl(file, cmd, (unsigned long) compat_ptr(arg));
+}
+#endif
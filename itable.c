@@ -0,0 +1,235 @@
+#include "bitsfs.h"
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+
+/*
+ * Lazy inode table initialization
+ *
+ * mkfs -O lazy_itable writes only the first BITSFS_ITABLE_CHUNK blocks of
+ * the inode table and records in s_itable_zeroed how many blocks from the
+ * start are known to be zero on disk. Blocks past that mark hold no
+ * allocated inode and read as zero without touching the disk.
+ *
+ * After mount a delayed work zeroes the rest one chunk at a time, waiting
+ * init_itable= milliseconds between chunks, with BLKZEROOUT when the device
+ * offers it. Allocating an inode past the mark zeroes up to its block first.
+ * The mark only moves after the blocks are zero on disk, and the lazy_itable
+ * feature is cleared once it reaches the end of the table.
+ */
+
+/*
+ * Whether table block `block' lies past the mark, chunks added by imap.c
+ * are zeroed when allocated
+ */
+static inline int bitsfs_itable_lazy(struct super_block *sb, unsigned long block)
+{
+    return block >= BITSFS_INDTBL_BLOCK &&
+        block - BITSFS_INDTBL_BLOCK < BITSFS_INDTBL_BLOCKS &&
+        block - BITSFS_INDTBL_BLOCK >= READ_ONCE(BITFS_S2SI(sb)->s_itable_zeroed);
+}
+
+/*
+ * Zero inode table blocks from the mark up to `upto', caller holds
+ * s_itable_mutex
+ */
+static int bitsfs_itable_zero(struct super_block *sb, unsigned long upto)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+    struct bitsfs_super_block *bs = sbi->s_bs;
+    unsigned long from = sbi->s_itable_zeroed;
+    int err;
+
+    upto = min_t(unsigned long, upto, BITSFS_INDTBL_BLOCKS);
+    if (upto <= from)
+        return 0;
+
+    err = sb_issue_zeroout(sb, BITSFS_INDTBL_BLOCK + from, upto - from, GFP_NOFS);
+    if (err)
+        goto out;
+
+    bs->s_itable_zeroed = cpu_to_le32(upto);
+    if (upto == BITSFS_INDTBL_BLOCKS)
+        bs->s_feature_incompat &= ~cpu_to_le32(BITSFS_FEATURE_INCOMPAT_LAZYITBL);
+    mark_buffer_dirty(sbi->s_sbh);
+    err = sync_dirty_buffer(sbi->s_sbh);
+    if (err)
+        goto out;
+
+    WRITE_ONCE(sbi->s_itable_zeroed, upto);
+out:
+    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Zeroed inode table blocks %lu-%lu, err=%d", from, upto - 1, err);
+    return err;
+}
+
+/*
+ * Make sure the table block of inode `ino', about to be allocated, is
+ * zero on disk
+ */
+int bitsfs_itable_init(struct super_block *sb, ino_t ino)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+    unsigned long offset, n;
+    int err;
+
+    if (ino > bitsfs_static_inodes(sb))
+        return 0;
+    n = bitsfs_inode_block(sb, ino, &offset) - BITSFS_INDTBL_BLOCK;
+    if (n < READ_ONCE(sbi->s_itable_zeroed))
+        return 0;
+
+    mutex_lock(&sbi->s_itable_mutex);
+    err = bitsfs_itable_zero(sb, round_up(n + 1, BITSFS_ITABLE_CHUNK));
+    mutex_unlock(&sbi->s_itable_mutex);
+    return err;
+}
+
+/*
+ * sb_bread() of inode table block `block', which reads as zero past the mark
+ */
+struct buffer_head *bitsfs_itable_bread(struct super_block *sb, unsigned long block)
+{
+    struct buffer_head *bh;
+
+    if (!bitsfs_itable_lazy(sb, block))
+        return sb_bread(sb, block);
+
+    bh = sb_getblk(sb, block);
+    lock_buffer(bh);
+    if (!buffer_uptodate(bh) && bitsfs_itable_lazy(sb, block)) {
+        memset(bh->b_data, 0, bh->b_size);
+        set_buffer_uptodate(bh);
+    }
+    unlock_buffer(bh);
+    if (buffer_uptodate(bh))
+        return bh;
+
+    /* zeroed on disk in the meantime */
+    brelse(bh);
+    return sb_bread(sb, block);
+}
+
+/*
+ * sb_breadahead() of inode table block `block', nothing to read past the mark
+ */
+void bitsfs_itable_readahead(struct super_block *sb, unsigned long block)
+{
+    if (!bitsfs_itable_lazy(sb, block))
+        sb_breadahead(sb, block);
+}
+
+/*
+ * Block of inode table block number `n', counting the chunks after the
+ * static table
+ */
+static unsigned long bitsfs_itable_nth(struct super_block *sb, unsigned long n)
+{
+    unsigned long offset;
+
+    /* the first inode of the block */
+    return bitsfs_inode_block(sb, n * BITSFS_BLOCK_SIZE / BITFS_S2SI(sb)->s_inode_size + 1,
+            &offset);
+}
+
+/*
+ * bitsfs_write_inode() changed the table block of inode `ino'
+ */
+void bitsfs_itable_dirty(struct super_block *sb, ino_t ino)
+{
+    unsigned long n = (ino - 1) * BITFS_S2SI(sb)->s_inode_size / BITSFS_BLOCK_SIZE;
+
+    if (!test_bit(n, BITFS_S2SI(sb)->s_itable_dirty))
+        set_bit(n, BITFS_S2SI(sb)->s_itable_dirty);
+}
+
+/*
+ * sync_fs: write every changed inode table block once, all of them under
+ * one plug so that neighbouring blocks merge, then wait for them
+ *
+ * Writeback only copies inodes into their table blocks, 32 inodes of 128
+ * bytes share one, so this is where they go to the disk together.
+ */
+int bitsfs_itable_sync(struct super_block *sb, int wait)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+    struct buffer_head *bh;
+    struct blk_plug plug;
+    unsigned long n, nr = 0;
+    int err = 0;
+
+    mutex_lock(&sbi->s_itable_sync);
+    blk_start_plug(&plug);
+    for_each_set_bit(n, sbi->s_itable_dirty, BITSFS_ITABLE_MAX_BLOCKS) {
+        /* cleared first, a later bitsfs_write_inode() sets it again */
+        clear_bit(n, sbi->s_itable_dirty);
+        bh = sb_find_get_block(sb, bitsfs_itable_nth(sb, n));
+        if (!bh)
+            continue;
+        write_dirty_buffer(bh, wait ? REQ_SYNC : 0);
+        brelse(bh);
+        if (wait)
+            set_bit(n, sbi->s_itable_flight);
+        nr++;
+    }
+    blk_finish_plug(&plug);
+
+    for_each_set_bit(n, sbi->s_itable_flight, BITSFS_ITABLE_MAX_BLOCKS) {
+        clear_bit(n, sbi->s_itable_flight);
+        bh = sb_find_get_block(sb, bitsfs_itable_nth(sb, n));
+        if (!bh)
+            continue;
+        wait_on_buffer(bh);
+        if (!buffer_uptodate(bh) && !err)
+            err = -EIO;
+        brelse(bh);
+    }
+    mutex_unlock(&sbi->s_itable_sync);
+
+    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Synced inode table, blocks=%lu wait=%d err=%d", nr, wait, err);
+    return err;
+}
+
+static void bitsfs_itable_work(struct work_struct *work)
+{
+    struct bitsfs_sb_info *sbi = container_of(to_delayed_work(work),
+            struct bitsfs_sb_info, s_itable_work);
+    struct super_block *sb = sbi->s_sb;
+    int err;
+
+    mutex_lock(&sbi->s_itable_mutex);
+    err = bitsfs_itable_zero(sb, sbi->s_itable_zeroed + BITSFS_ITABLE_CHUNK);
+    mutex_unlock(&sbi->s_itable_mutex);
+
+    if (err) {
+        bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Inode table zeroing stopped at block %lu, err=%d",
+                sbi->s_itable_zeroed, err);
+        return;
+    }
+    if (READ_ONCE(sbi->s_itable_zeroed) < BITSFS_INDTBL_BLOCKS)
+        queue_delayed_work(system_long_wq, &sbi->s_itable_work,
+                msecs_to_jiffies(sbi->s_itable_delay));
+}
+
+/*
+ * Start zeroing the rest of the table in the background after mount
+ */
+void bitsfs_itable_start(struct super_block *sb)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+
+    INIT_DELAYED_WORK(&sbi->s_itable_work, bitsfs_itable_work);
+    if (sb_rdonly(sb) || !sbi->s_itable_delay ||
+            sbi->s_itable_zeroed >= BITSFS_INDTBL_BLOCKS)
+        return;
+    queue_delayed_work(system_long_wq, &sbi->s_itable_work,
+            msecs_to_jiffies(sbi->s_itable_delay));
+}
+
+void bitsfs_itable_stop(struct super_block *sb)
+{
+    cancel_delayed_work_sync(&BITFS_S2SI(sb)->s_itable_work);
+}
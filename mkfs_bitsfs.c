@@ -18,6 +18,7 @@
 #include <stddef.h>
 #include <string.h>
 #include <time.h>
+#include <dirent.h>
 #include "mkfs_bitsfs.h"
 
 #define    DFD    3
@@ -115,6 +116,54 @@ static void fill_inode(struct bitsfs_inode *inode)
     inode->i_links_count = 2; /* "/.", "/.." */
     inode->i_block[0] = BITSFS_DATA_BLOCK;
     inode->i_blocks = 1;
+    inode->i_flags = BITSFS_DIRCOUNT_FL;
+    inode->i_dir_entries = 0;
+}
+
+/*
+ * Name hash, must match bitsfs_name_hash() of the kernel module
+ */
+static uint32_t name_hash(const char *name, int len)
+{
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    const unsigned char *ucp = (const unsigned char *)name;
+
+    while (len--) {
+        hash = hash1 + (hash0 ^ (*ucp++ * 7152373));
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+/*
+ * "." and ".." with the vardent feature: ".." runs to the end of the block
+ */
+static void fill_root_vardent(void *buff, uint32_t features)
+{
+    struct bitsfs_dir_entry *de = (struct bitsfs_dir_entry *)buff;
+    int hlen = (features & BITSFS_FEATURE_INCOMPAT_DIRHASH) ? BITSFS_DIR_HASH_LEN : 0;
+    uint32_t hash;
+
+    de->inode = BITSFS_ROOT_INO;
+    de->rec_len = BITSFS_DIR_REC_LEN(1) + hlen;
+    de->name_len = 1;
+    de->file_type = BITSFS_FT_DIR;
+    de->name[0] = '.';
+    hash = name_hash(".", 1);
+    memcpy((char *)de + BITSFS_DIR_REC_LEN(1), &hash, hlen);
+
+    de = (struct bitsfs_dir_entry *)((char *)buff + BITSFS_DIR_REC_LEN(1) + hlen);
+    de->inode = BITSFS_ROOT_INO;
+    de->rec_len = BITSFS_BLOCK_SIZE - BITSFS_DIR_REC_LEN(1) - hlen;
+    de->name_len = 2;
+    de->file_type = BITSFS_FT_DIR;
+    de->name[0] = '.';
+    de->name[1] = '.';
+    hash = name_hash("..", 2);
+    memcpy((char *)de + BITSFS_DIR_REC_LEN(2), &hash, hlen);
 }
 
 static void fill_root_dir(struct bitsfs_dir_special *root_dir)
@@ -133,12 +182,427 @@ static void fill_root_dir(struct bitsfs_dir_special *root_dir)
     root_dir->name2[1] = '.';
 }
 
+/*
+ * Sealed image, -d <dir>
+ *
+ * The tree under <dir> is read breadth first and the children of each
+ * directory get consecutive inode numbers in name order, so seal_nodes[i]
+ * is inode i + BITSFS_ROOT_INO. On disk every directory is followed by the
+ * data of its files in the same order, each file one run of blocks, and
+ * files that fit in the inode are kept inline. Extents are packed end to
+ * end, which is why the kernel only mounts the result read-only.
+ */
+struct seal_node {
+    char        *path;
+    char        *name;          /* Last component of path */
+    int         name_len;
+    struct stat st;
+    uint32_t    parent;         /* Inode number of the parent directory */
+    uint32_t    first_kid;      /* Index of the first child */
+    uint32_t    nkids;
+    uint32_t    nsubdirs;
+    uint32_t    block;          /* First block */
+    uint32_t    nblocks;
+    int         is_inline;
+};
+
+/* direct blocks plus the extents of 1024 blocks behind the other slots */
+#define    SEAL_MAX_BLOCKS     (BITSFS_DDIR_BLOCKS + BITSFS_NDIR_BLOCKS * BITSFS_NDIR_BLOCK_COUNT)
+#define    SEAL_IO_SIZE        (1 << 20)
+
+static struct seal_node *seal_nodes;
+static uint32_t seal_count, seal_cap;
+
+/*
+ * Order of names in a sealed directory, must match bitsfs_sealed_cmp() of
+ * the kernel module
+ */
+static int seal_name_cmp(const void *a, const void *b)
+{
+    const struct seal_node *x = a, *y = b;
+    int cmp = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+
+    return cmp ? cmp : x->name_len - y->name_len;
+}
+
+static int seal_add(const char *dir, const char *name, uint32_t parent)
+{
+    struct seal_node *node;
+    size_t dlen = strlen(dir), nlen = strlen(name);
+
+    if (seal_count == seal_cap) {
+        seal_cap = seal_cap ? seal_cap * 2 : 64;
+        seal_nodes = realloc(seal_nodes, seal_cap * sizeof(*seal_nodes));
+        if (!seal_nodes) {
+            printf("Out of memory\n");
+            return -1;
+        }
+    }
+
+    node = &seal_nodes[seal_count];
+    memset(node, 0, sizeof(*node));
+    node->path = malloc(dlen + nlen + 2);
+    if (!node->path) {
+        printf("Out of memory\n");
+        return -1;
+    }
+    if (nlen)
+        sprintf(node->path, "%s/%s", dir, name);
+    else
+        strcpy(node->path, dir);
+    node->name = node->path + (nlen ? dlen + 1 : dlen);
+    node->name_len = nlen;
+    node->parent = parent;
+    if (lstat(node->path, &node->st) < 0) {
+        printf("Can't stat [ %s ]\n", node->path);
+        return -1;
+    }
+    seal_count++;
+    return 0;
+}
+
+/*
+ * Read the tree under `src', at most `max_inodes' inodes counting the
+ * reserved one
+ */
+static int seal_scan(const char *src, unsigned int max_name, uint32_t max_inodes)
+{
+    struct seal_node *node;
+    struct dirent *e;
+    uint32_t i, k, first;
+    DIR *d;
+
+    if (seal_add(src, "", BITSFS_ROOT_INO) < 0)
+        return -1;
+    if (!S_ISDIR(seal_nodes[0].st.st_mode)) {
+        printf("Not a directory [ %s ]\n", src);
+        return -1;
+    }
+
+    for (i = 0; i < seal_count; i++) {
+        if (!S_ISDIR(seal_nodes[i].st.st_mode))
+            continue;
+        d = opendir(seal_nodes[i].path);
+        if (!d) {
+            printf("Can't open dir [ %s ]\n", seal_nodes[i].path);
+            return -1;
+        }
+
+        first = seal_count;
+        while ((e = readdir(d)) != NULL) {
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+                continue;
+            if (strlen(e->d_name) > max_name) {
+                printf("Name too long [ %s/%s ]\n", seal_nodes[i].path, e->d_name);
+                goto fail;
+            }
+            if (seal_add(seal_nodes[i].path, e->d_name, i + BITSFS_ROOT_INO) < 0)
+                goto fail;
+
+            node = &seal_nodes[seal_count - 1];
+            if (!S_ISREG(node->st.st_mode) && !S_ISDIR(node->st.st_mode)) {
+                printf("Skip [ %s ], only files and directories are copied\n", node->path);
+                free(node->path);
+                seal_count--;
+                continue;
+            }
+            if (seal_count + BITSFS_ROOT_INO - 1 > max_inodes) {
+                printf("Too many files, the inode table holds %u\n", max_inodes);
+                goto fail;
+            }
+        }
+        closedir(d);
+
+        /* name order is also their inode order */
+        qsort(&seal_nodes[first], seal_count - first, sizeof(*seal_nodes), seal_name_cmp);
+        seal_nodes[i].first_kid = first;
+        seal_nodes[i].nkids = seal_count - first;
+        for (k = first; k < seal_count; k++)
+            if (S_ISDIR(seal_nodes[k].st.st_mode))
+                seal_nodes[i].nsubdirs++;
+    }
+    return 0;
+fail:
+    closedir(d);
+    return -1;
+}
+
+/*
+ * Lay out the entries of directory `dir', "." and ".." first, into `buff'
+ * when given. Returns the blocks they take.
+ */
+static uint32_t seal_dir_fill(uint32_t dir, char *buff, uint32_t features)
+{
+    struct seal_node *node = &seal_nodes[dir], *kid;
+    struct bitsfs_dir_entry *de, *prev = NULL;
+    int vardent = (features & BITSFS_FEATURE_INCOMPAT_VARDENT) != 0;
+    int hlen = (features & BITSFS_FEATURE_INCOMPAT_DIRHASH) ? BITSFS_DIR_HASH_LEN : 0;
+    uint32_t i, ino, off = 0, nblocks;
+    const char *name;
+    int len, type, rec_len;
+    uint32_t hash;
+
+    for (i = 0; i < node->nkids + 2; i++) {
+        if (i == 0) {
+            name = ".";
+            ino = dir + BITSFS_ROOT_INO;
+            type = BITSFS_FT_DIR;
+        } else if (i == 1) {
+            name = "..";
+            ino = node->parent;
+            type = BITSFS_FT_DIR;
+        } else {
+            kid = &seal_nodes[node->first_kid + i - 2];
+            name = kid->name;
+            ino = node->first_kid + i - 2 + BITSFS_ROOT_INO;
+            type = S_ISDIR(kid->st.st_mode) ? BITSFS_FT_DIR : BITSFS_FT_REG_FILE;
+        }
+        len = strlen(name);
+
+        rec_len = vardent ? BITSFS_DIR_REC_LEN(len) + hlen : (int)DENT_LEN;
+        /* entries stay inside a block, the last one reaches its end */
+        if (off % BITSFS_BLOCK_SIZE + rec_len > BITSFS_BLOCK_SIZE) {
+            if (prev)
+                prev->rec_len += BITSFS_BLOCK_SIZE - off % BITSFS_BLOCK_SIZE;
+            off += BITSFS_BLOCK_SIZE - off % BITSFS_BLOCK_SIZE;
+        }
+
+        if (buff) {
+            de = (struct bitsfs_dir_entry *)(buff + off);
+            de->inode = ino;
+            de->rec_len = rec_len;
+            de->name_len = len;
+            de->file_type = type;
+            memcpy(de->name, name, len);
+            hash = name_hash(name, len);
+            memcpy((char *)de + (vardent ? BITSFS_DIR_REC_LEN(len) : (int)DENT_LEN - hlen), &hash, hlen);
+            prev = de;
+        }
+        off += rec_len;
+    }
+
+    nblocks = (off + BITSFS_BLOCK_SIZE - 1) / BITSFS_BLOCK_SIZE;
+    if (prev && vardent)
+        prev->rec_len += nblocks * BITSFS_BLOCK_SIZE - off;
+    return nblocks;
+}
+
+/*
+ * Give each directory, then the files in it, their blocks from `next' on.
+ * Returns the first block past the image, 0 when it does not fit below
+ * `limit'.
+ */
+static uint32_t seal_layout(uint32_t next, uint32_t limit, uint32_t features,
+        unsigned int inline_size)
+{
+    struct seal_node *dir, *node;
+    uint32_t i, k;
+
+    for (i = 0; i < seal_count; i++) {
+        dir = &seal_nodes[i];
+        if (!S_ISDIR(dir->st.st_mode))
+            continue;
+
+        dir->nblocks = seal_dir_fill(i, NULL, features);
+        if (dir->nblocks > SEAL_MAX_BLOCKS) {
+            printf("Directory too large [ %s ]\n", dir->path);
+            return 0;
+        }
+        dir->block = next;
+        next += dir->nblocks;
+
+        for (k = dir->first_kid; k < dir->first_kid + dir->nkids; k++) {
+            node = &seal_nodes[k];
+            if (!S_ISREG(node->st.st_mode) || !node->st.st_size)
+                continue;
+            if (node->st.st_size <= inline_size) {
+                node->is_inline = 1;
+                continue;
+            }
+            if (node->st.st_size > (off_t)SEAL_MAX_BLOCKS * BITSFS_BLOCK_SIZE) {
+                printf("File too large [ %s ]\n", node->path);
+                return 0;
+            }
+            node->nblocks = (node->st.st_size + BITSFS_BLOCK_SIZE - 1) / BITSFS_BLOCK_SIZE;
+            node->block = next;
+            next += node->nblocks;
+        }
+    }
+
+    if (next > limit) {
+        printf("Image does not fit, needs %u blocks of %u\n", next, limit);
+        return 0;
+    }
+    return next;
+}
+
+static void seal_fill_inode(struct bitsfs_inode *inode, uint32_t i, unsigned int inode_size)
+{
+    struct seal_node *node = &seal_nodes[i];
+    struct bitsfs_inode_extra *ext;
+    uint32_t n;
+
+    inode->i_mode = node->st.st_mode;
+    inode->i_uid = node->st.st_uid;
+    inode->i_gid = node->st.st_gid;
+    inode->i_atime = node->st.st_atim.tv_sec;
+    inode->i_ctime = node->st.st_ctim.tv_sec;
+    inode->i_mtime = node->st.st_mtim.tv_sec;
+    inode->i_blocks = node->nblocks;
+    if (S_ISDIR(node->st.st_mode)) {
+        inode->i_size = node->nblocks * BITSFS_BLOCK_SIZE;
+        inode->i_links_count = 2 + node->nsubdirs;
+        inode->i_flags = BITSFS_DIRCOUNT_FL;
+        inode->i_dir_entries = node->nkids;
+    } else {
+        inode->i_size = node->st.st_size;
+        inode->i_links_count = 1;
+        if (node->is_inline)
+            inode->i_flags = BITSFS_INLINE_DATA_FL;
+    }
+
+    /* direct blocks, then each slot starts an extent, the last one cut short */
+    for (n = 0; n < BITSFS_DDIR_BLOCKS && n < node->nblocks; n++)
+        inode->i_block[n] = node->block + n;
+    for (n = BITSFS_DDIR_BLOCKS; n < BITSFS_TMAX_BLOCKS &&
+            BITSFS_DDIR_BLOCKS + (n - BITSFS_DDIR_BLOCKS) * BITSFS_NDIR_BLOCK_COUNT < node->nblocks; n++)
+        inode->i_block[n] = node->block + BITSFS_DDIR_BLOCKS +
+            (n - BITSFS_DDIR_BLOCKS) * BITSFS_NDIR_BLOCK_COUNT;
+
+    if (inode_size > BITSFS_GOOD_OLD_INODE_SIZE) {
+        ext = (struct bitsfs_inode_extra *)((char *)inode + BITSFS_GOOD_OLD_INODE_SIZE);
+        ext->i_atime_hi = (uint64_t)node->st.st_atim.tv_sec >> 32;
+        ext->i_ctime_hi = (uint64_t)node->st.st_ctim.tv_sec >> 32;
+        ext->i_mtime_hi = (uint64_t)node->st.st_mtim.tv_sec >> 32;
+        ext->i_atime_nsec = node->st.st_atim.tv_nsec;
+        ext->i_ctime_nsec = node->st.st_ctim.tv_nsec;
+        ext->i_mtime_nsec = node->st.st_mtim.tv_nsec;
+    }
+}
+
+/*
+ * Copy file `node' to its blocks, or to `dst' when inline
+ */
+static int seal_copy(int fd, struct seal_node *node, char *dst, char *buff)
+{
+    off_t done = 0;
+    ssize_t len;
+    size_t want;
+    int in;
+
+    in = open(node->path, O_RDONLY);
+    if (in < 0) {
+        printf("Can't open file [ %s ]\n", node->path);
+        return -1;
+    }
+    while (done < node->st.st_size) {
+        want = node->st.st_size - done;
+        if (want > SEAL_IO_SIZE)
+            want = SEAL_IO_SIZE;
+        len = read(in, dst ? dst + done : buff, want);
+        if (len <= 0)
+            break;
+        if (!dst && PUT(fd, (uint64_t)node->block * BITSFS_BLOCK_SIZE + done, buff, len) != len)
+            break;
+        done += len;
+    }
+    close(in);
+    if (done != node->st.st_size) {
+        printf("Copy file failed [ %s ]\n", node->path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Write the directories and files in layout order, then the inode table
+ * and the bitmaps of the `end - BITSFS_DATA_BLOCK' blocks in use
+ */
+static int seal_write(int fd, uint32_t features, unsigned int inode_size, uint32_t end)
+{
+    char *table, *bmp, *buff, *dbuff;
+    struct seal_node *dir, *node;
+    struct bitsfs_inode *inode;
+    uint32_t i, k, n;
+    int ret = -1;
+
+    table = calloc(BITSFS_INDTBL_BLOCKS, BITSFS_BLOCK_SIZE);
+    bmp = calloc(BITSFS_BLKBMP_BLOCKS + 1, BITSFS_BLOCK_SIZE);
+    buff = malloc(SEAL_IO_SIZE);
+    if (!table || !bmp || !buff) {
+        printf("Out of memory\n");
+        goto out;
+    }
+
+    for (i = 0; i < seal_count; i++) {
+        inode = (struct bitsfs_inode *)(table + (i + BITSFS_ROOT_INO - 1) * inode_size);
+        seal_fill_inode(inode, i, inode_size);
+    }
+
+    for (i = 0; i < seal_count; i++) {
+        dir = &seal_nodes[i];
+        if (!S_ISDIR(dir->st.st_mode))
+            continue;
+
+        dbuff = calloc(dir->nblocks, BITSFS_BLOCK_SIZE);
+        if (!dbuff) {
+            printf("Out of memory\n");
+            goto out;
+        }
+        seal_dir_fill(i, dbuff, features);
+        n = PUT(fd, (uint64_t)dir->block * BITSFS_BLOCK_SIZE, dbuff,
+                dir->nblocks * BITSFS_BLOCK_SIZE);
+        free(dbuff);
+        if (n != dir->nblocks * BITSFS_BLOCK_SIZE) {
+            printf("Put directory failed [ %s ]\n", dir->path);
+            goto out;
+        }
+
+        for (k = dir->first_kid; k < dir->first_kid + dir->nkids; k++) {
+            node = &seal_nodes[k];
+            if (!S_ISREG(node->st.st_mode))
+                continue;
+            inode = (struct bitsfs_inode *)(table + (k + BITSFS_ROOT_INO - 1) * inode_size);
+            if (seal_copy(fd, node, node->is_inline ? (char *)inode +
+                    BITSFS_GOOD_OLD_INODE_SIZE + BITSFS_INODE_EXTRA : NULL, buff) < 0)
+                goto out;
+        }
+    }
+
+    if (PUT(fd, BITSFS_INDTBL_BLOCK * BITSFS_BLOCK_SIZE, table,
+            BITSFS_INDTBL_BLOCKS * BITSFS_BLOCK_SIZE) != BITSFS_INDTBL_BLOCKS * BITSFS_BLOCK_SIZE) {
+        printf("Put inode table failed\n");
+        goto out;
+    }
+
+    /* the block bitmaps, then the inode bitmap right after them */
+    for (n = 0; n < end - BITSFS_DATA_BLOCK; n++)
+        bmp[n / 8] |= 1 << (n % 8);
+    for (n = BITSFS_ROOT_INO - 1; n < seal_count + BITSFS_ROOT_INO - 1; n++)
+        bmp[BITSFS_BLKBMP_BLOCKS * BITSFS_BLOCK_SIZE + n / 8] |= 1 << (n % 8);
+    if (PUT(fd, BITSFS_BLKBMP_BLOCK * BITSFS_BLOCK_SIZE, bmp,
+            (BITSFS_BLKBMP_BLOCKS + 1) * BITSFS_BLOCK_SIZE) !=
+            (BITSFS_BLKBMP_BLOCKS + 1) * BITSFS_BLOCK_SIZE) {
+        printf("Put bitmaps failed\n");
+        goto out;
+    }
+
+    printf("Sealed %u inodes in %u blocks\n", seal_count, end - BITSFS_DATA_BLOCK);
+    ret = 0;
+out:
+    free(table);
+    free(bmp);
+    free(buff);
+    return ret;
+}
+
 int main(int argc, char **argv)
 {
     int fd;
-    int nblocks = 0;
+    unsigned int nblocks = 0;
     int inode_count = 0;
     int block_count = 0;
+    int itable_blocks;
     unsigned int inode_size;
     unsigned int rdir_size;
     off_t kbytes;
@@ -149,13 +613,55 @@ int main(int argc, char **argv)
     struct bitsfs_dir_special *rdir;
     char *cbuff;
     void *buff;
+    uint32_t features = 0;
+    uint32_t data_end = 0;
+    unsigned int max_name;
+    char *src = NULL;
+    int opt;
 
-    if (argc <= 1) {
+    inode_size = sizeof(struct bitsfs_inode);
+    while ((opt = getopt(argc, argv, "O:I:d:")) != -1) {
+        switch (opt) {
+        case 'd':
+            src = optarg;
+            break;
+        case 'I':
+            /* larger inodes hold tiny directories inline */
+            inode_size = atoi(optarg);
+            if (inode_size < sizeof(struct bitsfs_inode) || inode_size > BITSFS_BLOCK_SIZE ||
+                    (inode_size & (inode_size - 1))) {
+                printf("Bad inode size [ %s ]\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'O':
+            if (strcmp(optarg, "vardent") == 0) {
+                features |= BITSFS_FEATURE_INCOMPAT_VARDENT;
+                break;
+            }
+            if (strcmp(optarg, "dirhash") == 0) {
+                features |= BITSFS_FEATURE_INCOMPAT_DIRHASH;
+                break;
+            }
+            if (strcmp(optarg, "lazy_itable") == 0) {
+                features |= BITSFS_FEATURE_INCOMPAT_LAZYITBL;
+                break;
+            }
+            printf("Unknown feature [ %s ]\n", optarg);
+            exit(EXIT_FAILURE);
+        default:
+            printf("Usage: %s [-O vardent] [-O dirhash] [-O lazy_itable] [-I inode-size] [-d dir] <dev>\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
         printf("Bad param");
         exit(EXIT_FAILURE);
     }
 
-    fd = open_dev(argv[1]);
+    fd = open_dev(argv[optind]);
     if (fd < 0) {
         exit(EXIT_FAILURE);
     }
@@ -185,13 +691,35 @@ int main(int argc, char **argv)
 
     /* Calc block count */
     nblocks = (kbytes * 1024 / BITSFS_BLOCK_SIZE);
-    inode_count = BITSFS_INDTBL_BLOCKS * BITSFS_BLOCK_SIZE / sizeof(struct bitsfs_inode);
-    inode_size = sizeof(struct bitsfs_inode);
+    inode_count = BITSFS_INDTBL_BLOCKS * BITSFS_BLOCK_SIZE / inode_size;
     rdir_size = sizeof(struct bitsfs_dir_special);
-    printf("nblocks=%d, inodes=%d, isize=%d, rdrsize=%d\n", nblocks, inode_count, inode_size, rdir_size);
+    printf("nblocks=%u, inodes=%d, isize=%d, rdrsize=%d\n", nblocks, inode_count, inode_size, rdir_size);
+
+    /* a sealed image is laid out in full before anything is written */
+    if (src) {
+        features |= BITSFS_FEATURE_INCOMPAT_SEALED;
+        features &= ~BITSFS_FEATURE_INCOMPAT_LAZYITBL;
+        max_name = (features & BITSFS_FEATURE_INCOMPAT_VARDENT) ? 255 :
+            DENT_NAME_LEN - ((features & BITSFS_FEATURE_INCOMPAT_DIRHASH) ? BITSFS_DIR_HASH_LEN : 0);
+        if (seal_scan(src, max_name, inode_count) < 0)
+            exit(EXIT_FAILURE);
+        data_end = BITSFS_DATA_BLOCK + BITSFS_BLKBMP_BLOCKS * BITSFS_BLOCK_SIZE * 8;
+        if (data_end > nblocks)
+            data_end = nblocks;
+        data_end = seal_layout(BITSFS_DATA_BLOCK, data_end, features,
+                inode_size > BITSFS_GOOD_OLD_INODE_SIZE + BITSFS_INODE_EXTRA ?
+                inode_size - BITSFS_GOOD_OLD_INODE_SIZE - BITSFS_INODE_EXTRA : 0);
+        if (!data_end)
+            exit(EXIT_FAILURE);
+    }
     
-    /* Allocate buff */
-    buff = malloc(BITSFS_BLOCK_SIZE);
+    /* the kernel zeroes the rest of a lazy inode table after mount */
+    itable_blocks = BITSFS_INDTBL_BLOCKS;
+    if (features & BITSFS_FEATURE_INCOMPAT_LAZYITBL)
+        itable_blocks = BITSFS_ITABLE_CHUNK;
+
+    /* Allocate buff, large enough for a chunk of the inode table */
+    buff = malloc(BITSFS_ITABLE_CHUNK * BITSFS_BLOCK_SIZE);
 
     /* Fill super block */
     memset(buff, 0, BITSFS_BLOCK_SIZE);
@@ -201,6 +729,13 @@ int main(int argc, char **argv)
     sb->s_blocks_count = nblocks;
     sb->s_free_inodes_count = sb->s_inodes_count - 1;
     sb->s_free_blocks_count = sb->s_blocks_count - BITSFS_DATA_BLOCK - 1;
+    sb->s_feature_incompat = features;
+    sb->s_inode_size = inode_size;
+    sb->s_itable_zeroed = itable_blocks;
+    if (src) {
+        sb->s_free_inodes_count = inode_count - seal_count;
+        sb->s_free_blocks_count = nblocks - data_end;
+    }
 
     /* Put super block */
     wlen = PUT(fd, BITSFS_SUPER_BLOCK * BITSFS_BLOCK_SIZE, sb, BITSFS_BLOCK_SIZE);
@@ -231,16 +766,23 @@ int main(int argc, char **argv)
         goto mend;
     }
 
-    /* Put inode table */
-    memset(buff, 0, BITSFS_BLOCK_SIZE);
-    for (int i = 0;i < BITSFS_INDTBL_BLOCKS; ++i) {
-        wlen = PUT(fd, (BITSFS_INDTBL_BLOCK + i) * BITSFS_BLOCK_SIZE, buff, BITSFS_BLOCK_SIZE);
-        if(wlen != BITSFS_BLOCK_SIZE) {
+    /* Put inode table, a chunk per write */
+    memset(buff, 0, BITSFS_ITABLE_CHUNK * BITSFS_BLOCK_SIZE);
+    for (int i = 0;i < itable_blocks; i += BITSFS_ITABLE_CHUNK) {
+        wlen = PUT(fd, (BITSFS_INDTBL_BLOCK + i) * BITSFS_BLOCK_SIZE, buff,
+                BITSFS_ITABLE_CHUNK * BITSFS_BLOCK_SIZE);
+        if(wlen != BITSFS_ITABLE_CHUNK * BITSFS_BLOCK_SIZE) {
             printf("Put inode table failed, wlen=%d\n", wlen);
             goto mend;
         }
     }
 
+    if (src) {
+        if (seal_write(fd, features, inode_size, data_end) < 0)
+            printf("Seal image failed\n");
+        goto mend;
+    }
+
     /* Fill root inode */
     memset(buff, 0, BITSFS_BLOCK_SIZE);
     inode = (struct bitsfs_inode*)buff;
@@ -258,7 +800,17 @@ int main(int argc, char **argv)
     /* Fill root dir entry */
     memset(buff, 0, BITSFS_BLOCK_SIZE);
     rdir = (struct bitsfs_dir_special*)buff;
-    fill_root_dir(rdir);
+    if (features & BITSFS_FEATURE_INCOMPAT_VARDENT) {
+        fill_root_vardent(buff, features);
+    } else {
+        fill_root_dir(rdir);
+        if (features & BITSFS_FEATURE_INCOMPAT_DIRHASH) {
+            uint32_t hash = name_hash(".", 1);
+            memcpy(rdir->name1 + DENT_NAME_LEN - BITSFS_DIR_HASH_LEN, &hash, BITSFS_DIR_HASH_LEN);
+            hash = name_hash("..", 2);
+            memcpy(rdir->name2 + DENT_NAME_LEN - BITSFS_DIR_HASH_LEN, &hash, BITSFS_DIR_HASH_LEN);
+        }
+    }
 
     wlen = PUT(fd, BITSFS_DATA_BLOCK * BITSFS_BLOCK_SIZE, rdir, BITSFS_BLOCK_SIZE);
     printf("wlen5=%d\n", wlen);
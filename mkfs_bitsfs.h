@@ -21,6 +21,15 @@
 #define    BITSFS_ERROR_FS         0x0002    /* Errors detected */
 #define    BITSFS_CORRUPTED        177       /* Filesystem corrupted */
 
+/*
+ * Incompatible features
+ */
+#define    BITSFS_FEATURE_INCOMPAT_VARDENT  0x0001  /* Variable length dirents */
+#define    BITSFS_FEATURE_INCOMPAT_DIRHASH  0x0002  /* Name hash stored in dirents */
+#define    BITSFS_FEATURE_INCOMPAT_LAZYITBL 0x0004  /* Inode table zeroed up to s_itable_zeroed */
+#define    BITSFS_FEATURE_INCOMPAT_DYNINODE 0x0008  /* Inode table chunks in data space, set by the kernel */
+#define    BITSFS_FEATURE_INCOMPAT_SEALED   0x0010  /* Packed read-only image made with -d */
+
 /*
  * Codes for operating systems
  */
@@ -56,6 +65,11 @@
 #define    BITSFS_INDTBL_BLOCKS    128  /* Inode table blocks count */
 #define    BITSFS_DATA_BLOCK       135  /* Data block start number */
 
+/*
+ * Inode table blocks written at a time, and all that is written with lazy_itable
+ */
+#define    BITSFS_ITABLE_CHUNK     8
+
 /*
  * Special inode numbers
  */
@@ -65,9 +79,21 @@
 /*
  * Dir file types
  */
+/*
+ * Inode flags
+ */
+#define    BITSFS_DIRCOUNT_FL      0x04000000    /* i_dir_entries counts the directory */
+#define    BITSFS_INLINE_DATA_FL   0x10000000    /* Data lives in the inode */
+
 #define    BITSFS_FT_UNKNOWN       0
 #define    BITSFS_FT_REG_FILE      1
 #define    BITSFS_FT_DIR           2
+#define    BITSFS_FT_CHRDEV        3
+#define    BITSFS_FT_BLKDEV        4
+#define    BITSFS_FT_FIFO          5
+#define    BITSFS_FT_SOCK          6
+#define    BITSFS_FT_SYMLINK       7
+#define    BITSFS_FT_MAX           8
 
 /*
  * Bitsfs super block on the disk
@@ -90,7 +116,11 @@ struct bitsfs_super_block {
     uint16_t    s_state;               /* File system state */
     uint32_t    s_creator_os;          /* OS */
     char        s_name[8];             /* Fs name */
-    uint32_t    s_reserved[239];       /* Padding to the end of the block 1024 bytes */
+    uint32_t    s_feature_incompat;    /* Incompatible feature set */
+    uint32_t    s_itable_zeroed;       /* Inode table blocks initialized, with lazy_itable */
+    uint32_t    s_imap_block;          /* Inode chunk map, 0 before the kernel adds a chunk */
+    uint32_t    s_last_orphan;         /* Newest inode on the orphan list */
+    uint32_t    s_reserved[235];       /* Padding to the end of the block 1024 bytes */
 };
 
 /*
@@ -111,7 +141,28 @@ struct bitsfs_inode {
     uint32_t    i_block[BITSFS_TMAX_BLOCKS];  /* Pointers to blocks */
     uint32_t    i_file_acl;       /* File ACL */
     uint32_t    i_dir_acl;        /* Directory ACL */
-    uint32_t    i_reserved[5];    /* Padding to 128 bytes */
+    uint32_t    i_dx_block;       /* Directory hash index extent */
+    uint32_t    i_dir_holes;      /* Reusable dirent slots of a directory */
+    uint32_t    i_dir_entries;    /* Live entries of a directory besides "." and ".." */
+    uint32_t    i_next_orphan;    /* Next inode on the orphan list */
+    uint32_t    i_reserved[1];    /* Padding to 128 bytes */
+};
+
+/*
+ * Fields after the first 128 bytes of a larger inode, its inline data
+ * starts BITSFS_INODE_EXTRA bytes further
+ */
+#define    BITSFS_GOOD_OLD_INODE_SIZE  128
+#define    BITSFS_INODE_EXTRA          32
+
+struct bitsfs_inode_extra {
+    uint32_t    i_atime_hi;       /* High 32 bits of the seconds */
+    uint32_t    i_ctime_hi;
+    uint32_t    i_mtime_hi;
+    uint32_t    i_atime_nsec;
+    uint32_t    i_ctime_nsec;
+    uint32_t    i_mtime_nsec;
+    uint32_t    i_extra_reserved[2];
 };
 
 #define DENT_NAME_LEN    56
@@ -129,6 +180,16 @@ struct bitsfs_dir_entry {
 
 #define DENT_LEN sizeof(struct bitsfs_dir_entry)  // 64 bytes
 
+/*
+ * Entry length with the vardent feature
+ */
+#define BITSFS_DIR_REC_LEN(nlen)    (((nlen) + 8 + 3) & ~3)
+
+/*
+ * Name hash at the end of each entry with the dirhash feature
+ */
+#define BITSFS_DIR_HASH_LEN  4
+
 /*
  * Directory entry of "/.", "/..",
  */
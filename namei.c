@@ -5,11 +5,8 @@ static struct dentry *bitsfs_lookup(struct inode *dir, struct dentry *dentry, un
     struct inode *inode;
     ino_t ino;
     int res;
-    
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_lookup start, d_name=%s", dentry->d_name.name);
 
-    if (dentry->d_name.len > DENT_NAME_LEN)
+    if (dentry->d_name.len > bitsfs_max_name_len(dir->i_sb))
         return ERR_PTR(-ENAMETOOLONG);
 
     res = bitsfs_get_ino_by_name(dir, &dentry->d_name, &ino);
@@ -32,8 +29,6 @@ static inline int bitsfs_add_nondir(struct dentry *dentry, struct inode *inode)
 {
     int err = bitsfs_add_link(dentry, inode);
     if (!err) {
-        bitsfs_msg(inode->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_add_nondir, i_state=%d", (inode->i_state & I_NEW));
         d_instantiate_new(dentry, inode);
         return 0;
     }
@@ -47,16 +42,10 @@ static int bitsfs_create(struct inode *dir, struct dentry *dentry,
 {
     struct inode *inode;
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_create start");
-
     inode = bitsfs_new_inode(dir, mode, &dentry->d_name);
     if (IS_ERR(inode))
         return PTR_ERR(inode);
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_create end, dir_ino=%lu, mode=%d", dir->i_ino, (inode->i_mode));
-
     bitsfs_set_file_ops(inode);
     mark_inode_dirty(inode);
     return bitsfs_add_nondir(dentry, inode);
@@ -68,15 +57,17 @@ static int bitsfs_link(struct dentry * old_dentry, struct inode * dir,
     struct inode *inode = d_inode(old_dentry);
     int err;
 
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_link start");
-
     inode->i_ctime = current_time(inode);
     inode_inc_link_count(inode);
     ihold(inode);
 
     err = bitsfs_add_link(dentry, inode);
     if (!err) {
+        /* an O_TMPFILE file got its first name */
+        if (inode->i_nlink == 1) {
+            bitsfs_orphan_del(inode);
+            mark_inode_dirty(inode);
+        }
         d_instantiate(dentry, inode);
         return 0;
     }
@@ -84,8 +75,6 @@ static int bitsfs_link(struct dentry * old_dentry, struct inode * dir,
     inode_dec_link_count(inode);
     iput(inode);
 
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_link end");
     return err;
 }
 
@@ -97,17 +86,12 @@ static int bitsfs_unlink(struct inode *dir, struct dentry *dentry)
     struct page *page;
     void *page_addr;
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_unlink start, ino=%lu", inode->i_ino);
-    
     de = bitsfs_find_entry(dir, &dentry->d_name, &page, &page_addr);
     if (IS_ERR(de)) {
         err = PTR_ERR(de);
         goto out;
     }
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_unlink delete entry, page=%p page_addr=%p", page, page_addr);
     err = bitsfs_delete_entry(dir, de, page, page_addr);
     bitsfs_put_page(page, page_addr);
     if (err)
@@ -115,10 +99,11 @@ static int bitsfs_unlink(struct inode *dir, struct dentry *dentry)
 
     inode->i_ctime = dir->i_ctime;
     inode_dec_link_count(inode);
+    /* still open files are deleted by the last iput, or after a crash */
+    if (!inode->i_nlink)
+        bitsfs_orphan_add(inode);
     err = 0;
 
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_unlink end, ino=%lu", inode->i_ino);
 out:
     return err;
 }
@@ -128,9 +113,6 @@ static int bitsfs_mkdir(struct inode *dir, struct dentry * dentry, umode_t mode)
     struct inode * inode;
     int err;
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_mkdir start");
-
     inode_inc_link_count(dir);
 
     inode = bitsfs_new_inode(dir, S_IFDIR | mode, &dentry->d_name);
@@ -138,9 +120,6 @@ static int bitsfs_mkdir(struct inode *dir, struct dentry * dentry, umode_t mode)
     if (IS_ERR(inode))
         goto out_dir;
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_mkdir new inode, ino=%lu", inode->i_ino);
-    
     bitsfs_set_dir_ops(inode);
     inode_inc_link_count(inode);
 
@@ -148,20 +127,12 @@ static int bitsfs_mkdir(struct inode *dir, struct dentry * dentry, umode_t mode)
     if (err)
         goto out_fail;
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_mkdir make empty");
-    
     err = bitsfs_add_link(dentry, inode);
     if (err)
         goto out_fail;
 
-    bitsfs_msg(dir->i_sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "bitsfs_mkdir add link");
-    
     d_instantiate_new(dentry, inode);
 
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_mkdir end");
 out:
     return err;
 
@@ -179,19 +150,15 @@ static int bitsfs_rmdir (struct inode *dir, struct dentry *dentry)
     struct inode * inode = d_inode(dentry);
     int err = -ENOTEMPTY;
 
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_rmdir start");
-
     if (bitsfs_empty_dir(inode)) {
         err = bitsfs_unlink(dir, dentry);
         if (!err) {
             inode->i_size = 0;
             inode_dec_link_count(inode);
             inode_dec_link_count(dir);
+            bitsfs_orphan_add(inode);
         }
     }
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_rmdir end");
     return err;
 }
 
@@ -199,9 +166,6 @@ static int bitsfs_tmpfile(struct inode *dir, struct dentry *dentry, umode_t mode
 {
     struct inode *inode;
 
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_tmpfile start");
-
     inode = bitsfs_new_inode(dir, mode, NULL);
     if (IS_ERR(inode))
         return PTR_ERR(inode);
@@ -209,10 +173,9 @@ static int bitsfs_tmpfile(struct inode *dir, struct dentry *dentry, umode_t mode
     bitsfs_set_file_ops(inode);
     mark_inode_dirty(inode);
     d_tmpfile(dentry, inode);
+    bitsfs_orphan_add(inode);
     unlock_new_inode(inode);
 
-    bitsfs_msg(dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_tmpfile end");
     return 0;
 }
 
@@ -231,9 +194,6 @@ static int bitsfs_rename (
     struct bitsfs_dir_entry *dir_de = NULL;
     struct bitsfs_dir_entry *old_de = NULL;
 
-    bitsfs_msg(old_dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_rename start");
-
     if (flags & ~RENAME_NOREPLACE)
         return -EINVAL;
 
@@ -272,6 +232,8 @@ static int bitsfs_rename (
         if (dir_de)
             drop_nlink(new_inode);
         inode_dec_link_count(new_inode);
+        if (!new_inode->i_nlink)
+            bitsfs_orphan_add(new_inode);
     } else {
         err = bitsfs_add_link(new_dentry, old_inode);
         if (err)
@@ -298,8 +260,6 @@ static int bitsfs_rename (
         inode_dec_link_count(old_dir);
     }
 
-    bitsfs_msg(old_dir->i_sb, KERN_ERR, __func__, __FILE__, __LINE__, 
-            "bitsfs_tmpfile end");
     bitsfs_put_page(old_page, old_page_addr);
     return 0;
 
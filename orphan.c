@@ -0,0 +1,160 @@
+#include "bitsfs.h"
+#include <linux/buffer_head.h>
+
+/*
+ * Orphan list
+ *
+ * An inode whose last link goes away while it is still open, and an inode
+ * whose blocks are being truncated, is put on a list on disk: s_last_orphan
+ * of the super block names the newest one and i_next_orphan of each inode
+ * the one after it. An inode leaves the list once it is deleted or the
+ * truncate is done. After a crash the mount finishes the work for exactly
+ * the inodes on the list, so recovery takes as long as there are orphans,
+ * whatever the size of the volume. A truncate waits for its entry to reach
+ * disk before it frees the first block.
+ *
+ * s_orphans keeps the same list in memory, newest first, to find the inode
+ * before one that leaves. s_orphan_mutex protects both lists.
+ */
+
+void bitsfs_orphan_add(struct inode *inode)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(inode->i_sb);
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(inode);
+    struct bitsfs_super_block *bs = sbi->s_bs;
+
+    mutex_lock(&sbi->s_orphan_mutex);
+    if (!list_empty(&bi->i_orphan))
+        goto out;
+
+    bi->i_next_orphan = le32_to_cpu(bs->s_last_orphan);
+    bs->s_last_orphan = cpu_to_le32(inode->i_ino);
+    list_add(&bi->i_orphan, &sbi->s_orphans);
+    mark_buffer_dirty(sbi->s_sbh);
+    mark_inode_dirty(inode);
+
+    bitsfs_msg(inode->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Orphan added, ino=%lu next=%u", inode->i_ino, bi->i_next_orphan);
+out:
+    mutex_unlock(&sbi->s_orphan_mutex);
+}
+
+/*
+ * Write the entry of `inode' and wait for it, the inode before the super
+ * block that names it
+ */
+int bitsfs_orphan_sync(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct buffer_head *bh;
+    struct bitsfs_inode *raw_inode;
+    int err;
+
+    err = bitsfs_write_inode(inode, NULL);
+    if (err)
+        goto out;
+    raw_inode = bitsfs_read_inode(sb, inode->i_ino, &bh);
+    if (IS_ERR(raw_inode)) {
+        err = PTR_ERR(raw_inode);
+        goto out;
+    }
+    err = sync_dirty_buffer(bh);
+    brelse(bh);
+    if (!err)
+        err = sync_dirty_buffer(BITFS_S2SI(sb)->s_sbh);
+out:
+    if (err)
+        bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Cannot write orphan, ino=%lu err=%d", inode->i_ino, err);
+    return err;
+}
+
+/*
+ * Take `inode' off the list, the caller writes the inode itself if it
+ * stays in use
+ */
+void bitsfs_orphan_del(struct inode *inode)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(inode->i_sb);
+    struct bitsfs_inode_info *bi = BITSFS_I2BI(inode);
+    struct bitsfs_inode_info *prev;
+
+    mutex_lock(&sbi->s_orphan_mutex);
+    if (list_empty(&bi->i_orphan))
+        goto out;
+
+    if (bi->i_orphan.prev == &sbi->s_orphans) {
+        sbi->s_bs->s_last_orphan = cpu_to_le32(bi->i_next_orphan);
+        mark_buffer_dirty(sbi->s_sbh);
+    } else {
+        prev = list_entry(bi->i_orphan.prev, struct bitsfs_inode_info, i_orphan);
+        prev->i_next_orphan = bi->i_next_orphan;
+        mark_inode_dirty(&prev->vfs_inode);
+    }
+    list_del_init(&bi->i_orphan);
+    bi->i_next_orphan = 0;
+
+    bitsfs_msg(inode->i_sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Orphan removed, ino=%lu", inode->i_ino);
+out:
+    mutex_unlock(&sbi->s_orphan_mutex);
+}
+
+/*
+ * Finish what a crash interrupted: delete the unlinked inodes on the list
+ * and truncate the others to their size
+ */
+void bitsfs_orphan_cleanup(struct super_block *sb)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+    struct bitsfs_super_block *bs = sbi->s_bs;
+    unsigned long limit = le32_to_cpu(bs->s_inodes_count);
+    unsigned long deleted = 0, truncated = 0;
+    struct inode *inode;
+    ino_t ino;
+
+    if (!bs->s_last_orphan)
+        return;
+    if (sb_rdonly(sb)) {
+        bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
+                "Read-only mount, orphans left for the next one");
+        return;
+    }
+
+    while ((ino = le32_to_cpu(bs->s_last_orphan)) && limit--) {
+        inode = bitsfs_iget(sb, ino);
+        if (IS_ERR(inode)) {
+            bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                    "Bad orphan inode %lu, err=%ld, dropping the list",
+                    ino, PTR_ERR(inode));
+            break;
+        }
+
+        /* the newest orphan on disk is the head in memory too */
+        mutex_lock(&sbi->s_orphan_mutex);
+        list_add(&BITSFS_I2BI(inode)->i_orphan, &sbi->s_orphans);
+        mutex_unlock(&sbi->s_orphan_mutex);
+
+        if (inode->i_nlink) {
+            bitsfs_truncate_blocks(inode, inode->i_size);
+            truncated++;
+        } else {
+            deleted++;
+        }
+        /* evicts and deletes an unlinked inode */
+        iput(inode);
+
+        if (le32_to_cpu(bs->s_last_orphan) == ino) {
+            bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                    "Orphan inode %lu stays on the list, dropping it", ino);
+            break;
+        }
+    }
+
+    if (bs->s_last_orphan) {
+        bs->s_last_orphan = 0;
+        mark_buffer_dirty(sbi->s_sbh);
+    }
+    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Orphan cleanup, deleted=%lu truncated=%lu", deleted, truncated);
+}
@@ -0,0 +1,90 @@
+#include "bitsfs.h"
+#include <linux/pagemap.h>
+
+/*
+ * Sealed images
+ *
+ * mkfs -d copies a directory tree into a new file system and seals it: the
+ * inodes are numbered breadth first, every directory is followed on disk by
+ * the data of its files in name order, files that fit in the inode are kept
+ * inline, and the entries of each directory after "." and ".." are sorted by
+ * bitsfs_sealed_cmp(). Extents are packed end to end, so a sealed image is
+ * never written again: the sealed incompat feature makes it mount read-only
+ * only, without loading the bitmaps.
+ *
+ * Lookups binary search the pages of a directory by their first name and
+ * then scan one page in order, log2(pages) + 1 page reads, no name cache,
+ * bloom filter or start-lookup hint to keep up.
+ */
+
+/*
+ * Order of names in a sealed directory, bytewise then by length
+ */
+static int bitsfs_sealed_cmp(const struct qstr *child, struct bitsfs_dir_entry *de)
+{
+    int cmp = memcmp(child->name, de->name, min_t(unsigned int, child->len, de->name_len));
+
+    return cmp ? cmp : (int)child->len - de->name_len;
+}
+
+/*
+ * First sorted entry of page `n', NULL when there is none
+ */
+static struct bitsfs_dir_entry *bitsfs_sealed_first(unsigned long n, void *page_addr,
+        char *limit)
+{
+    struct bitsfs_dir_entry *de = page_addr;
+
+    /* "." and ".." lead page 0 */
+    if (!n && (char *)de < limit && de->rec_len)
+        de = bitsfs_next_entry(de);
+    if (!n && (char *)de < limit && de->rec_len)
+        de = bitsfs_next_entry(de);
+    if ((char *)de >= limit || !de->rec_len || !de->inode)
+        return NULL;
+    return de;
+}
+
+struct bitsfs_dir_entry *bitsfs_sealed_find_entry(struct inode *dir,
+        const struct qstr *child, struct page **res_page, void **res_page_addr)
+{
+    unsigned long lo = 0, hi = dir_pages(dir) - 1, n;
+    struct bitsfs_dir_entry *de;
+    struct page *page;
+    void *page_addr;
+    char *limit;
+    int cmp;
+
+    /* the last page whose first name is not past `child' */
+    for (;;) {
+        n = lo + (hi - lo + 1) / 2;
+        page = bitsfs_get_page(dir, n, 0, &page_addr);
+        if (IS_ERR(page))
+            return ERR_CAST(page);
+
+        limit = (char *)page_addr +
+            min_t(loff_t, PAGE_SIZE, dir->i_size - ((loff_t)n << PAGE_SHIFT));
+        de = bitsfs_sealed_first(n, page_addr, limit);
+        cmp = de ? bitsfs_sealed_cmp(child, de) : -1;
+        if (lo == hi || !cmp)
+            break;
+        bitsfs_put_page(page, page_addr);
+        if (cmp < 0)
+            hi = n - 1;
+        else
+            lo = n;
+    }
+
+    for (; de && (char *)de < limit && de->rec_len; de = bitsfs_next_entry(de)) {
+        cmp = bitsfs_sealed_cmp(child, de);
+        if (!cmp) {
+            *res_page = page;
+            *res_page_addr = page_addr;
+            return de;
+        }
+        if (cmp < 0)
+            break;
+    }
+    bitsfs_put_page(page, page_addr);
+    return ERR_PTR(-ENOENT);
+}
@@ -17,20 +17,41 @@
 #include <linux/iversion.h>
 #include "bitsfs.h"
 
+#define CREATE_TRACE_POINTS
+#include "bitsfs_trace.h"
+
+/* on while a mount with option debug is up, see bitsfs_msg() */
+DEFINE_STATIC_KEY_FALSE(bitsfs_debug_key);
+
+void __bitsfs_msg(struct super_block *sb, const char *prefix, const char *func,
+        const char *file, int line, const char *fmt, ...)
+{
+    struct va_format vaf;
+    va_list args;
+    va_start(args, fmt);
+    vaf.fmt = fmt;
+    vaf.va = &args;
+    printk("%sBitsFS-%s: %pV -at %s() of %s(%d)\n", prefix, sb->s_id, &vaf, func, file, line);
+    va_end(args);
+}
+
 /** inode cache */
 static struct kmem_cache * bitsfs_inode_cachep;
 
 static struct inode *bitsfs_alloc_inode(struct super_block *sb)
 {
 	struct bitsfs_inode_info *bi;
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "Alloc inode start");
 	bi = kmem_cache_alloc(bitsfs_inode_cachep, GFP_KERNEL);
 	if (!bi)
 		return NULL;
 	inode_set_iversion(&bi->vfs_inode, 1);
-    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
-            "Alloc inode end, bi=%p", bi);
+	RCU_INIT_POINTER(bi->i_dcache, NULL);
+	RCU_INIT_POINTER(bi->i_bloom, NULL);
+	bi->i_dir_holemap = NULL;
+	bi->i_dir_state = 0;
+	bi->i_dir_prealloc = 0;
+	bi->i_next_orphan = 0;
+	INIT_LIST_HEAD(&bi->i_orphan);
 	return &bi->vfs_inode;
 }
 
@@ -42,23 +63,133 @@ static void bitsfs_free_kcache(struct inode *inode)
 static void bitsfs_put_super(struct super_block * sb)
 {
 	struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+	bitsfs_itable_stop(sb);
+	unregister_shrinker(&sbi->s_dcache_shrinker);
 	percpu_counter_destroy(&sbi->s_freeblocks_counter);
 	percpu_counter_destroy(&sbi->s_freeinodes_counter);
 	percpu_counter_destroy(&sbi->s_dirs_counter);
+	percpu_counter_destroy(&sbi->s_bloom_probes);
+	percpu_counter_destroy(&sbi->s_bloom_negative);
+	percpu_counter_destroy(&sbi->s_bloom_false_pos);
+	brelse (sbi->s_imap_bh);
+	kfree(sbi->s_itable_dirty);
+	kfree(sbi->s_itable_flight);
 	brelse (sbi->s_sbh);
 	sb->s_fs_info = NULL;
 	fs_put_dax(sbi->s_daxdev);
+	if (sbi->s_debug)
+		static_branch_dec(&bitsfs_debug_key);
 	kfree(sbi);
 }
 
+static int bitsfs_sync_fs(struct super_block *sb, int wait)
+{
+    return bitsfs_itable_sync(sb, wait);
+}
+
+/*
+ * Mount options stay as they were, a sealed image stays read-only
+ */
+static int bitsfs_remount(struct super_block *sb, int *flags, char *data)
+{
+    if (bitsfs_sealed(sb) && !(*flags & SB_RDONLY))
+        return -EROFS;
+    return 0;
+}
+
+static int bitsfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(root->d_sb);
+
+    if (sbi->s_dcache_max != BITSFS_DCACHE_DEFAULT)
+        seq_printf(seq, ",dir_cache=%lu", sbi->s_dcache_max);
+    if (sbi->s_bloom_bits != BITSFS_BLOOM_DEFAULT)
+        seq_printf(seq, ",dir_bloom=%u", sbi->s_bloom_bits);
+    if (sbi->s_itable_delay != BITSFS_ITABLE_DELAY)
+        seq_printf(seq, ",init_itable=%u", sbi->s_itable_delay);
+    if (sbi->s_warmup)
+        seq_puts(seq, ",warmup");
+    if (sbi->s_debug)
+        seq_puts(seq, ",debug");
+    return 0;
+}
+
 static const struct super_operations bitsfs_sb_ops = {
     .alloc_inode    = bitsfs_alloc_inode,
     .write_inode    = bitsfs_write_inode,
     .destroy_inode	= bitsfs_free_kcache,
     .evict_inode    = bitsfs_evict_inode,
     .put_super      = bitsfs_put_super,
+    .sync_fs        = bitsfs_sync_fs,
+    .remount_fs     = bitsfs_remount,
+    .show_options   = bitsfs_show_options,
+};
+
+/*
+ * Mount options
+ */
+enum {
+    Opt_dir_cache, Opt_dir_bloom, Opt_init_itable, Opt_warmup, Opt_debug, Opt_err
 };
 
+static const match_table_t tokens = {
+    {Opt_dir_cache, "dir_cache=%u"},
+    {Opt_dir_bloom, "dir_bloom=%u"},
+    {Opt_init_itable, "init_itable=%u"},
+    {Opt_warmup, "warmup"},
+    {Opt_debug, "debug"},
+    {Opt_err, NULL}
+};
+
+static int parse_options(char *options, struct super_block *sb)
+{
+    char *p;
+    substring_t args[MAX_OPT_ARGS];
+    int option;
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+
+    if (!options)
+        return 1;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        int token;
+        if (!*p)
+            continue;
+
+        token = match_token(p, tokens, args);
+        switch (token) {
+        case Opt_dir_cache:
+            if (match_int(&args[0], &option) || option < 0)
+                return 0;
+            sbi->s_dcache_max = option;
+            break;
+        case Opt_dir_bloom:
+            if (match_int(&args[0], &option) || option < 0 || option > BITSFS_BLOOM_MAX)
+                return 0;
+            sbi->s_bloom_bits = option;
+            break;
+        case Opt_init_itable:
+            if (match_int(&args[0], &option) || option < 0)
+                return 0;
+            sbi->s_itable_delay = option;
+            break;
+        case Opt_warmup:
+            sbi->s_warmup = 1;
+            break;
+        case Opt_debug:
+            if (!sbi->s_debug)
+                static_branch_inc(&bitsfs_debug_key);
+            sbi->s_debug = 1;
+            break;
+        default:
+            bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                    "Unrecognized mount option \"%s\" or missing value", p);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static int bitsfs_fill_super(struct super_block *sb, void *data, int silent)
 {
     int ret = 0;
@@ -82,6 +213,30 @@ static int bitsfs_fill_super(struct super_block *sb, void *data, int silent)
     }
     sb->s_fs_info = sbi;
 
+    spin_lock_init(&sbi->s_dcache_lock);
+    INIT_LIST_HEAD(&sbi->s_dcache_lru);
+    atomic_long_set(&sbi->s_dcache_slots, 0);
+    sbi->s_dcache_max = BITSFS_DCACHE_DEFAULT;
+    sbi->s_bloom_bits = BITSFS_BLOOM_DEFAULT;
+    spin_lock_init(&sbi->s_dsync_lock);
+    INIT_LIST_HEAD(&sbi->s_dsync_list);
+    init_waitqueue_head(&sbi->s_dsync_wait);
+    sbi->s_sb = sb;
+    sbi->s_itable_delay = BITSFS_ITABLE_DELAY;
+    mutex_init(&sbi->s_itable_mutex);
+    mutex_init(&sbi->s_imap_mutex);
+    mutex_init(&sbi->s_itable_sync);
+    INIT_LIST_HEAD(&sbi->s_orphans);
+    mutex_init(&sbi->s_orphan_mutex);
+    sbi->s_itable_dirty = kcalloc(BITS_TO_LONGS(BITSFS_ITABLE_MAX_BLOCKS),
+            sizeof(long), GFP_KERNEL);
+    sbi->s_itable_flight = kcalloc(BITS_TO_LONGS(BITSFS_ITABLE_MAX_BLOCKS),
+            sizeof(long), GFP_KERNEL);
+    if (!sbi->s_itable_dirty || !sbi->s_itable_flight) {
+        ret = -ENOMEM;
+        goto failed;
+    }
+
     blocksize = sb_min_blocksize(sb, BITSFS_BLOCK_SIZE);
     if (blocksize != BITSFS_BLOCK_SIZE) {
 		sb_block = (sb_block * BITSFS_BLOCK_SIZE) / blocksize;
@@ -108,8 +263,6 @@ static int bitsfs_fill_super(struct super_block *sb, void *data, int silent)
     sb->s_magic = le16_to_cpu(bs->s_magic);
     sb->s_flags |= SB_POSIXACL;
     sb->s_blocksize = le32_to_cpu(bs->s_block_size);
-    sb->s_time_min = S32_MIN;
-    sb->s_time_max = S32_MAX;
 
     bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__, 
             "finish reading bitsfs super block, s_name=%s s_magic=%d s_magic=%lu", 
@@ -117,6 +270,62 @@ static int bitsfs_fill_super(struct super_block *sb, void *data, int silent)
     
     if (sb->s_magic != BITSFS_SUPER_MAGIC)
         goto cantfind_bitsfs;
+
+    if (le32_to_cpu(bs->s_feature_incompat) & ~BITSFS_FEATURE_INCOMPAT_SUPP) {
+        bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Unsupported optional features (%x)",
+                le32_to_cpu(bs->s_feature_incompat) & ~BITSFS_FEATURE_INCOMPAT_SUPP);
+        ret = -EINVAL;
+        goto failed;
+    }
+
+    if (bitsfs_sealed(sb) && !sb_rdonly(sb)) {
+        bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Sealed image, mount it read-only");
+        ret = -EROFS;
+        goto failed;
+    }
+
+    sbi->s_inode_size = le32_to_cpu(bs->s_inode_size);
+    if (sbi->s_inode_size < BITSFS_GOOD_OLD_INODE_SIZE || sbi->s_inode_size > blocksize ||
+            !is_power_of_2(sbi->s_inode_size)) {
+        bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Unsupported inode size %d", sbi->s_inode_size);
+        ret = -EINVAL;
+        goto failed;
+    }
+
+    ret = bitsfs_imap_load(sb);
+    if (ret)
+        goto failed;
+
+    sbi->s_itable_zeroed = BITSFS_INDTBL_BLOCKS;
+    if (BITSFS_HAS_INCOMPAT_FEATURE(sb, BITSFS_FEATURE_INCOMPAT_LAZYITBL))
+        sbi->s_itable_zeroed = min_t(unsigned long, le32_to_cpu(bs->s_itable_zeroed),
+                BITSFS_INDTBL_BLOCKS);
+
+    /* large inodes keep 64 bit seconds and nanoseconds */
+    if (sbi->s_inode_size > BITSFS_GOOD_OLD_INODE_SIZE) {
+        sb->s_time_gran = 1;
+        sb->s_time_min = TIME64_MIN;
+        sb->s_time_max = TIME64_MAX;
+    } else {
+        sb->s_time_gran = NSEC_PER_SEC;
+        sb->s_time_min = S32_MIN;
+        sb->s_time_max = S32_MAX;
+    }
+
+    if (!parse_options((char *) data, sb)) {
+        ret = -EINVAL;
+        goto failed;
+    }
+
+    if (percpu_counter_init(&sbi->s_bloom_probes, 0, GFP_KERNEL) ||
+            percpu_counter_init(&sbi->s_bloom_negative, 0, GFP_KERNEL) ||
+            percpu_counter_init(&sbi->s_bloom_false_pos, 0, GFP_KERNEL)) {
+        ret = -ENOMEM;
+        goto failed;
+    }
     
     sb->s_op = &bitsfs_sb_ops;
 
@@ -137,8 +346,11 @@ static int bitsfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto failed;
 	}
 
-    set_root_block_bitmap(root, 0);
-    set_root_inode_bitmap(root, BITSFS_ROOT_INO - 1);
+    /* nothing is ever allocated on a sealed image */
+    if (!bitsfs_sealed(sb)) {
+        set_root_block_bitmap(root, 0);
+        set_root_inode_bitmap(root, BITSFS_ROOT_INO - 1);
+    }
 
 	sb->s_root = d_make_root(root);
 	if (!sb->s_root) {
@@ -148,12 +360,34 @@ static int bitsfs_fill_super(struct super_block *sb, void *data, int silent)
 		goto failed;
 	}
 
+    sbi->s_dcache_shrinker.count_objects = bitsfs_dcache_count;
+    sbi->s_dcache_shrinker.scan_objects = bitsfs_dcache_scan;
+    sbi->s_dcache_shrinker.seeks = DEFAULT_SEEKS;
+    if (register_shrinker(&sbi->s_dcache_shrinker)) {
+        bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__,
+                "Cannot register dir cache shrinker, dir_cache disabled");
+        sbi->s_dcache_max = 0;
+    }
+    bitsfs_orphan_cleanup(sb);
+    bitsfs_itable_start(sb);
+    bitsfs_warmup_start(sb);
+
     bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,  "End fill super block");
     return 0;
 cantfind_bitsfs:
     bitsfs_msg(sb, KERN_ERR, __func__, __FILE__, __LINE__, 
             "Cannot find valid bitsfs on disk");
 failed:
+    if (sbi) {
+        if (sbi->s_debug)
+            static_branch_dec(&bitsfs_debug_key);
+        percpu_counter_destroy(&sbi->s_bloom_probes);
+        percpu_counter_destroy(&sbi->s_bloom_negative);
+        percpu_counter_destroy(&sbi->s_bloom_false_pos);
+        brelse(sbi->s_imap_bh);
+        kfree(sbi->s_itable_dirty);
+        kfree(sbi->s_itable_flight);
+    }
     brelse(bh);
     kfree(sbi);
     return ret;
@@ -174,6 +408,7 @@ static void kill_super_block(struct super_block *sb)
             "kill_super_block, dentry=%p rinode=%p i_state=%lu", root, 
             rinode, rinode->i_state);
     WARN_ON((rinode->i_state & I_NEW));
+    bitsfs_warmup_stop(sb);
 	kill_block_super(sb);
     bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,  "kill_super_block end");
 }
@@ -181,7 +416,7 @@ static void kill_super_block(struct super_block *sb)
 static struct dentry *bitsfs_mount(struct file_system_type *fs_type,
     int flags, const char *dev_name, void *data) 
 {
-    printk("Bitsfs bitsfs_mount name=%s, dev=%s\n", fs_type->name, dev_name);
+    pr_debug("Bitsfs bitsfs_mount name=%s, dev=%s\n", fs_type->name, dev_name);
     return mount_bdev(fs_type, flags, dev_name, data, bitsfs_fill_super);
 }
 
@@ -226,25 +461,27 @@ static int __init init_bitsfs(void)
     err = init_inodecache();
     if (err)
         return err;
-    printk("Bitsfs init_bitsfs init inode cache\n");
+    pr_debug("Bitsfs init_bitsfs init inode cache\n");
     err = register_filesystem(&bitsfs_type);
     if (err)
         goto out;
     
-    printk("Bitsfs init_bitsfs end\n");
+    pr_debug("Bitsfs init_bitsfs end\n");
     return 0;
 out:
-    printk("Bitsfs init_bitsfs err=%d\n", err);
+    pr_err("Bitsfs init_bitsfs err=%d\n", err);
     destroy_inodecache();
     return err;
 }
 
 static void __exit exit_bitsfs(void)
 {
-    printk("Bitsfs exit_bitsfs start \n");
+    pr_debug("Bitsfs exit_bitsfs start \n");
+    /* name caches and bloom filters freed by call_rcu() from module text */
+    rcu_barrier();
     unregister_filesystem(&bitsfs_type);
     destroy_inodecache();
-    printk("Bitsfs exit_bitsfs end \n");
+    pr_debug("Bitsfs exit_bitsfs end \n");
 }
 
 MODULE_AUTHOR("Aaron of BitsObject.com");
@@ -0,0 +1,161 @@
+#include "bitsfs.h"
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/pagemap.h>
+#include <linux/workqueue.h>
+
+/*
+ * Metadata warmup, mount option warmup
+ *
+ * Right after mount every bitmap block, inode table block and directory page
+ * is a cold synchronous read the first time a lookup or an allocation needs
+ * it. With -o warmup a work queued at the end of the mount reads them ahead
+ * instead: the bitmaps and the whole inode table, chunks included, under one
+ * plug so that neighbouring blocks go out as large reads, then the pages of
+ * the root directory and of up to BITSFS_WARMUP_DIRS directories in it.
+ * Nothing waits for the reads, the mount returns at once and what memory
+ * pressure drops is simply read again on demand.
+ */
+
+#define BITSFS_WARMUP_DIRS      256    /* Top-level directories read ahead */
+
+/*
+ * Read ahead the bitmaps and the inode table, returns the blocks asked for
+ */
+static unsigned long bitsfs_warmup_meta(struct super_block *sb)
+{
+    unsigned long inodes = le32_to_cpu(BITFS_S2SI(sb)->s_bs->s_inodes_count);
+    unsigned long per_block = BITSFS_BLOCK_SIZE / BITFS_S2SI(sb)->s_inode_size;
+    unsigned long block, offset, k, ino, nr = 0;
+    struct blk_plug plug;
+
+    blk_start_plug(&plug);
+    for (block = BITSFS_BLKBMP_BLOCK; block < BITSFS_INDTBL_BLOCK; block++, nr++)
+        sb_breadahead(sb, block);
+    for (k = 1; k * BITSFS_INODES_PER_BITMAP < inodes; k++) {
+        block = bitsfs_imap_bitmap(sb, k);
+        if (block) {
+            sb_breadahead(sb, block);
+            nr++;
+        }
+    }
+    /* the static table, then the chunks in inode number order */
+    for (ino = 1; ino <= inodes; ino += per_block, nr++)
+        bitsfs_itable_readahead(sb, bitsfs_inode_block(sb, ino, &offset));
+    blk_finish_plug(&plug);
+    return nr;
+}
+
+static void bitsfs_warmup_dir(struct inode *dir)
+{
+    struct file_ra_state ra;
+
+    file_ra_state_init(&ra, dir->i_mapping);
+    page_cache_sync_readahead(dir->i_mapping, &ra, NULL, 0, dir_pages(dir));
+}
+
+/*
+ * Collect the inode numbers of the directories in the root, at most `max'
+ */
+static unsigned int bitsfs_warmup_subdirs(struct inode *root, ino_t *inos, unsigned int max)
+{
+    unsigned long i, npages = dir_pages(root);
+    unsigned int nr = 0;
+    struct bitsfs_dir_entry *de;
+    struct page *page;
+    void *page_addr;
+    char *limit;
+
+    inode_lock_shared(root);
+    for (i = 0; i < npages && nr < max; i++) {
+        page = bitsfs_get_page(root, i, 0, &page_addr);
+        if (IS_ERR(page))
+            break;
+
+        de = (struct bitsfs_dir_entry *)page_addr;
+        limit = (char *)page_addr +
+            min_t(loff_t, PAGE_SIZE, root->i_size - ((loff_t)i << PAGE_SHIFT));
+        while ((char *)de < limit && de->rec_len && nr < max) {
+            if (de->inode && de->file_type == FT_DIR &&
+                    le32_to_cpu(de->inode) != root->i_ino && !(de->name[0] == '.' &&
+                    de->name_len == 2 && de->name[1] == '.'))
+                inos[nr++] = le32_to_cpu(de->inode);
+            de = bitsfs_next_entry(de);
+        }
+        bitsfs_put_page(page, page_addr);
+    }
+    inode_unlock_shared(root);
+    return nr;
+}
+
+/*
+ * Read ahead the root directory and the directories in it, returns how many
+ */
+static unsigned int bitsfs_warmup_dirs(struct super_block *sb)
+{
+    struct inode *root = d_inode(sb->s_root);
+    struct blk_plug plug;
+    struct inode *inode;
+    unsigned long offset;
+    unsigned int i, nr;
+    ino_t *inos;
+
+    bitsfs_warmup_dir(root);
+
+    inos = kmalloc_array(BITSFS_WARMUP_DIRS, sizeof(*inos), GFP_KERNEL);
+    if (!inos)
+        return 1;
+    nr = bitsfs_warmup_subdirs(root, inos, BITSFS_WARMUP_DIRS);
+
+    /* their inodes first, bitsfs_iget() then finds the table blocks cached */
+    blk_start_plug(&plug);
+    for (i = 0; i < nr; i++)
+        bitsfs_itable_readahead(sb, bitsfs_inode_block(sb, inos[i], &offset));
+    blk_finish_plug(&plug);
+
+    for (i = 0; i < nr; i++) {
+        inode = bitsfs_iget(sb, inos[i]);
+        if (IS_ERR(inode))
+            continue;
+        if (S_ISDIR(inode->i_mode))
+            bitsfs_warmup_dir(inode);
+        iput(inode);
+    }
+    kfree(inos);
+    return nr + 1;
+}
+
+static void bitsfs_warmup_work(struct work_struct *work)
+{
+    struct bitsfs_sb_info *sbi = container_of(work, struct bitsfs_sb_info, s_warmup_work);
+    struct super_block *sb = sbi->s_sb;
+    unsigned long blocks;
+    unsigned int dirs;
+
+    blocks = bitsfs_warmup_meta(sb);
+    dirs = bitsfs_warmup_dirs(sb);
+
+    bitsfs_msg(sb, KERN_INFO, __func__, __FILE__, __LINE__,
+            "Warmup issued, metadata blocks=%lu dirs=%u", blocks, dirs);
+}
+
+/*
+ * Queue the warmup at the end of the mount
+ */
+void bitsfs_warmup_start(struct super_block *sb)
+{
+    struct bitsfs_sb_info *sbi = BITFS_S2SI(sb);
+
+    INIT_WORK(&sbi->s_warmup_work, bitsfs_warmup_work);
+    if (sbi->s_warmup)
+        queue_work(system_unbound_wq, &sbi->s_warmup_work);
+}
+
+/*
+ * Called before the inodes are evicted at unmount, the work holds some
+ */
+void bitsfs_warmup_stop(struct super_block *sb)
+{
+    cancel_work_sync(&BITFS_S2SI(sb)->s_warmup_work);
+}